@@ -0,0 +1,37 @@
+#ifndef OUTPUTKEYS_H
+#define OUTPUTKEYS_H
+
+#include <map>
+#include <string>
+#include "TDirectory.h"
+#include "TString.h"
+#include "TKey.h"
+#include "TClass.h"
+
+// Key scans of the Efficiency*.root outputs, shared by RatePlotter and plotVariations.C.
+// Rate maps are <name> and its variations <name>__<suffix>; the toy covariances are written
+// next to them as <name>_cov and <name>_cov__<suffix>.
+
+// Toy covariance of a rate map or of one of its variations
+inline bool isCovariance(const TString& name){
+  int pos = name.Index("__");
+  TString base = (pos<0) ? name : TString(name(0,pos));
+  return base.EndsWith("_cov");
+}
+
+// Highest cycle of every key in d whose class inherits from baseClass, by name
+inline std::map<std::string, TKey*> latestKeys(TDirectory *d, const char* baseClass="TH1"){
+  std::map<std::string, TKey*> keys;
+  if(!d) return keys;
+  TKey *key(0);
+  TIter next(d->GetListOfKeys());
+  while(( key = (TKey*)next() )){
+    TClass *cl = TClass::GetClass(key->GetClassName());
+    if(!cl || !cl->InheritsFrom(baseClass)) continue;
+    auto it = keys.find(key->GetName());
+    if(it == keys.end() || it->second->GetCycle() < key->GetCycle()) keys[key->GetName()] = key;
+  }
+  return keys;
+}
+
+#endif
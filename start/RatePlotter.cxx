@@ -6,6 +6,279 @@ void RatePlotter::setDebug(bool debug){
   return;
 }
 
+void RunStats::addTime(const std::string& stage, double seconds){
+  std::lock_guard<std::mutex> guard(lock);
+  if(!stages.count(stage)) order.push_back(stage);
+  stages[stage].first  += seconds;
+  stages[stage].second += 1;
+}
+
+void RunStats::count(const std::string& counter, double n){
+  std::lock_guard<std::mutex> guard(lock);
+  counts[counter] += n;
+}
+
+void RunStats::clear(){
+  std::lock_guard<std::mutex> guard(lock);
+  order.clear();
+  stages.clear();
+  counts.clear();
+  start = std::chrono::steady_clock::now();
+}
+
+bool RunStats::writeJSON(const char* filename) const {
+  std::lock_guard<std::mutex> guard(lock);
+  std::ofstream out(filename);
+  if(!out.is_open()) return false;
+
+  out << "{\n  \"wallTime\": " << wallTime() << ",\n  \"stages\": {";
+  for(unsigned int i(0); i<order.size(); i++){
+    const std::pair<double, long> &st = stages.at(order[i]);
+    out << (i ? "," : "") << "\n    \"" << order[i] << "\": {\"calls\": " << st.second << ", \"seconds\": " << st.first << "}";
+  }
+  out << "\n  },\n  \"counters\": {";
+  unsigned int i(0);
+  for(auto &c : counts) out << (i++ ? "," : "") << "\n    \"" << c.first << "\": " << Form("%.0f", c.second);
+  out << "\n  }\n}\n";
+  out.close();
+  return true;
+}
+
+void RatePlotter::runReport(const char* jsonFile){
+  //Input files that are still open have not been counted yet
+  for(auto f : InFiles) this->countBytesRead(f, false);
+
+  //Report rows are not subject to the log limit
+  writeLog("runReport", "INFO", Form("%-14s %10s %12s", "Stage", "Calls", "Time [s]"), false);
+  for(auto &stage : Stats.stageNames())
+    writeLog("runReport", "INFO", Form("%-14s %10li %12.3f", stage.c_str(), Stats.calls(stage), Stats.time(stage)), false);
+  for(auto &c : Stats.counters())
+    writeLog("runReport", "INFO", Form("%-14s %10.0f", c.first.c_str(), c.second), false);
+  writeLog("runReport", "INFO", Form("%-14s %10s %12.3f", "Total (wall)", "", Stats.wallTime()), false);
+
+  if(!TString(jsonFile).Length()) return;
+  if(Stats.writeJSON(jsonFile)) INFO("runReport", Form("Wrote run report %s", jsonFile));
+  else INFO("runReport", Form("Cannot write run report %s", jsonFile));
+}
+
+void MemoryTracker::add(TObject *obj, const char* method){
+  std::lock_guard<std::mutex> guard(lock);
+  if(!registered){ gROOT->GetListOfCleanups()->Add(this); registered = true; }
+  obj->SetBit(kMustCleanup);
+  live[obj] = method;
+}
+
+void MemoryTracker::RecursiveRemove(TObject *obj){
+  std::lock_guard<std::mutex> guard(lock);
+  live.erase(obj);
+}
+
+void MemoryTracker::stop(){
+  std::lock_guard<std::mutex> guard(lock);
+  live.clear();
+  if(gROOT && gROOT->GetListOfCleanups()){ while(gROOT->GetListOfCleanups()->Remove(this)); }
+  registered = false;
+}
+
+int MemoryTracker::category(TObject *obj){
+  if(obj->InheritsFrom("TH1"))    return 0;
+  if(obj->InheritsFrom("TGraph")) return 1;
+  if(obj->InheritsFrom("TPad"))   return 2;
+  return 3;
+}
+
+double MemoryTracker::bytes(TObject *obj){
+  double size = obj->IsA()->Size();
+  if(obj->InheritsFrom("TH1")){
+    TH1 *h = (TH1*)obj;
+    size += h->GetNcells()*(h->InheritsFrom("TArrayF") ? sizeof(float) : sizeof(double)) + h->GetSumw2N()*sizeof(double);
+  }
+  else if(obj->InheritsFrom("TGraph")){
+    size += ((TGraph*)obj)->GetN()*sizeof(double)*(obj->InheritsFrom("TGraphAsymmErrors") ? 6 : 2);
+  }
+  else if(obj->InheritsFrom("TPad")){
+    TIter next(((TPad*)obj)->GetListOfPrimitives());
+    while(TObject *prim = next()){ if(prim->InheritsFrom("TPad")) size += bytes(prim); }
+  }
+  return size;
+}
+
+void MemoryTracker::summary(std::map<std::string, std::vector<double> > &counts) const {
+  std::lock_guard<std::mutex> guard(lock);
+  for(auto &obj : live){
+    std::vector<double> &c = counts[obj.second];
+    if(c.empty()) c.assign(5, 0.);
+    c[category(obj.first)] += 1;
+    c[4] += bytes(obj.first);
+  }
+}
+
+TFile* OutputWriter::open(const std::string& filename){
+  auto f = files.find(filename);
+  if(f != files.end()) return f->second;
+
+  TDirectory::TContext context;
+  TFile *file = TFile::Open(filename.c_str(), "UPDATE");
+  if(!file || file->IsZombie()){ delete file; return 0; }
+
+  //ROOT closes open files at exit, the cleanup list tells the writer about it
+  if(!registered){ gROOT->GetListOfCleanups()->Add(this); registered = true; }
+  file->SetBit(kMustCleanup);
+  files[filename] = file;
+  return file;
+}
+
+void OutputWriter::queue(const std::string& filename, TH1 *h){
+  std::lock_guard<std::mutex> guard(queueLock);
+  if(!running){
+    stopping = false;
+    running  = true;
+    worker   = std::thread(&OutputWriter::run, this);
+  }
+  pending.push_back(std::make_pair(filename, h));
+  wake.notify_one();
+}
+
+void OutputWriter::run(){
+  std::unique_lock<std::mutex> guard(queueLock);
+  while(true){
+    wake.wait(guard, [this]{ return !pending.empty() || stopping; });
+    if(pending.empty()) break;
+
+    //Everything queued while the previous batch was written goes into the next one
+    std::vector< std::pair<std::string, TH1*> > batch(0);
+    batch.swap(pending);
+    writing = true;
+    guard.unlock();
+    {
+      std::lock_guard<std::mutex> fguard(fileLock);
+      for(auto &item : batch){
+	auto f = files.find(item.first);
+	if(f != files.end()){ f->second->WriteTObject(item.second); nWritten++; }
+	delete item.second;
+      }
+    }
+    guard.lock();
+    writing = false;
+    idle.notify_all();
+  }
+}
+
+void OutputWriter::flush(){
+  std::unique_lock<std::mutex> guard(queueLock);
+  idle.wait(guard, [this]{ return pending.empty() && !writing; });
+}
+
+void OutputWriter::close(){
+  {
+    std::lock_guard<std::mutex> guard(queueLock);
+    stopping = true;
+  }
+  wake.notify_all();
+  if(worker.joinable()) worker.join();
+  running = false;
+
+  std::lock_guard<std::mutex> guard(fileLock);
+  if(gROOT && gROOT->GetListOfCleanups()){ while(gROOT->GetListOfCleanups()->Remove(this)); }
+  registered = false;
+  for(auto &f : files){ f.second->Close(); delete f.second; }
+  files.clear();
+}
+
+void OutputWriter::RecursiveRemove(TObject *obj){
+  if(!obj->InheritsFrom("TFile")) return;
+  std::lock_guard<std::mutex> guard(fileLock);
+  for(auto f = files.begin(); f != files.end(); ++f){
+    if(f->second == obj){ files.erase(f); break; }
+  }
+}
+
+std::map<std::string, TH1*>& RatePlotter::nominalIndex(TFile *f){
+  auto index = nominals.find(f->GetName());
+  if(index != nominals.end()) return index->second;
+
+  //Only nominal keys are read, for several cycles the highest one is kept
+  std::map<std::string, TH1*> &hists = nominals[f->GetName()];
+  for(auto &k : latestKeys(f)){
+    if(TString(k.first).Contains("__")) continue;
+    TH1 *h = (TH1*)k.second->ReadObj();
+    h->SetDirectory(0);
+    hists[k.first] = h;
+  }
+  RP_DEBUG("subtractNominal", Form("Indexed %i nominal histograms in %s", (int)hists.size(), f->GetName()));
+  return hists;
+}
+
+void RatePlotter::clearNominals(){
+  for(auto &file : nominals){ for(auto &h : file.second) delete h.second; }
+  nominals.clear();
+}
+
+void RatePlotter::flushOutput(){
+  Writer.close();
+  if(Writer.written()) INFO("flushOutput", Form("%i histograms written to the output files", Writer.written()));
+}
+
+void RatePlotter::setMemoryTracking(bool track){
+  TrackMemory = track;
+  if(!TrackMemory) Memory.stop();
+  INFO("setMemoryTracking", Form("Track live objects %i",TrackMemory));
+}
+
+void RatePlotter::track(HistRegistry &histos, const char* method){
+  if(!TrackMemory) return;
+  for(auto h : histos.list())   Memory.add(h, method);
+  for(auto h : histos.list2D()) Memory.add(h, method);
+}
+
+void RatePlotter::memoryReport(const char* title){
+  std::map<std::string, std::vector<double> > counts;
+  Memory.summary(counts);
+
+  INFO("memoryReport", Form("%s: %i objects", title, Memory.size()));
+  INFO("memoryReport", Form("%-20s %8s %8s %8s %8s %10s", "Method", "Histos", "Graphs", "Canvases", "Other", "Size [MB]"));
+  std::vector<double> total(5, 0.);
+  for(auto &c : counts){
+    INFO("memoryReport", Form("%-20s %8.0f %8.0f %8.0f %8.0f %10.2f", c.first.c_str(), c.second[0], c.second[1], c.second[2], c.second[3], c.second[4]/1048576.));
+    for(unsigned int i(0); i<total.size(); i++) total[i] += c.second[i];
+  }
+  INFO("memoryReport", Form("%-20s %8.0f %8.0f %8.0f %8.0f %10.2f", "Total", total[0], total[1], total[2], total[3], total[4]/1048576.));
+
+  ProcInfo_t info;
+  if(gSystem->GetProcInfo(&info)==0) INFO("memoryReport", Form("Resident memory of the process: %.1f MB", info.fMemResident/1024.));
+}
+
+void RatePlotter::setLogBuffer(bool buffer){
+  LogBuffer = buffer;
+  INFO("setLogBuffer", Form("Buffered output %i",LogBuffer));
+}
+
+void RatePlotter::setLogLimit(int limit){
+  LogLimit = limit>0 ? limit : 0;
+  INFO("setLogLimit", Form("Messages per method limited to %i",LogLimit));
+}
+
+void RatePlotter::writeLog(const char* app, const char* level, const char* msg, bool limited){
+  //Also called from the merge workers
+  std::lock_guard<std::mutex> guard(logLock);
+  if(limited && LogLimit && ++logCounts[app] > LogLimit) return;
+
+  if(!LogBuffer){ std::cout << Form("%s::%s() \t\t %s \t %s",CNAME.c_str(),app,level,msg) << std::endl; return; }
+  logStream << Form("%s::%s() \t\t %s \t %s",CNAME.c_str(),app,level,msg) << "\n";
+  if(logStream.tellp() > 65536){ std::cout << logStream.str() << std::flush; logStream.str(""); }
+}
+
+void RatePlotter::flushLog(){
+  std::lock_guard<std::mutex> guard(logLock);
+  std::cout << logStream.str();
+  logStream.str("");
+  for(auto &count : logCounts){
+    if(count.second > LogLimit) std::cout << Form("%s::%s() \t\t INFO \t %i further messages suppressed",CNAME.c_str(),count.first.c_str(),count.second-LogLimit) << "\n";
+  }
+  logCounts.clear();
+  std::cout << std::flush;
+}
+
 void RatePlotter::setPrint(bool print){
   Print = print;
   INFO("setPrint", Form("Print %i",Print));
@@ -21,6 +294,61 @@ void RatePlotter::setEffDirectory(const char* dir){
   INFO("setEffDirectory", Form("Efficiency dir: %s",effDir));
 }
 
+void RatePlotter::setLazyLoading(bool lazy){
+  LazyLoad = lazy;
+  INFO("setLazyLoading", Form("Lazy loading %i",LazyLoad));
+}
+
+void RatePlotter::setThreads(int n){
+  NThreads = n>1 ? n : 1;
+  INFO("setThreads", Form("Merging input files with %i threads",NThreads));
+}
+
+void RatePlotter::setClampOnce(bool once){
+  ClampOnce = once;
+  INFO("setClampOnce", Form("Clamp subtracted contents at zero only after all terms %i",ClampOnce));
+}
+
+void RatePlotter::setToys(int nToys, unsigned int seed){
+  NToys   = nToys;
+  ToySeed = seed;
+  INFO("setToys", Form("Rate map uncertainties from %i toys (seed %u)", NToys, ToySeed));
+}
+
+void RatePlotter::setStreaming(bool stream){
+  Streaming = stream;
+  INFO("setStreaming", Form("Close input files after reading %i",Streaming));
+}
+
+void RatePlotter::countBytesRead(TFile *f, bool closing){
+  Long64_t bytes = f->GetBytesRead();
+  Stats.count("bytesRead", bytes - countedBytes[f]);
+  if(closing) countedBytes.erase(f);
+  else countedBytes[f] = bytes;
+}
+
+void RatePlotter::resetRunReport(){
+  Stats.clear();
+  for(auto f : InFiles) countedBytes[f] = f->GetBytesRead();
+}
+
+void RatePlotter::closeFiles(){
+  for(auto f : InFiles){ this->countBytesRead(f, true); f->Close(); delete f; }
+  if(!InFiles.empty()) RP_DEBUG("closeFiles", Form("Closed %i input files", (int)InFiles.size()));
+  InFiles.clear();
+}
+
+void RatePlotter::setCacheDir(std::string dir){
+  cacheDir = dir;
+  if(cacheDir.length() && gSystem->AccessPathName(cacheDir.c_str())) gSystem->mkdir(cacheDir.c_str(), true);
+  INFO("setCacheDir", Form("Input cache dir: %s",cacheDir.c_str()));
+}
+
+void RatePlotter::setUseCache(bool use){
+  UseCache = use;
+  INFO("setUseCache", Form("Use input cache %i",UseCache));
+}
+
 void RatePlotter::writeHistFile(const char* outname, bool writeH){
   writeHist = writeH;
   outFile   = outname;
@@ -38,11 +366,120 @@ void RatePlotter::setStyle(bool setAtlas){
   gStyle->SetOptTitle(0);
   gStyle->SetOptStat(000000);
   if(!setAtlas) return;
+  renderStyle = stylePath;
   gROOT->LoadMacro(stylePath);
   gROOT->ProcessLine("SetAtlasStyle()");
   return;
 }
 
+void RatePlotter::setBatchRender(int workers){
+  RenderWorkers = workers>0 ? workers : 0;
+  if(RenderWorkers) gROOT->SetBatch(kTRUE);
+  INFO("setBatchRender", Form("Rendering figures with %i worker processes",RenderWorkers));
+}
+
+void RatePlotter::exportCanvas(TCanvas *c, const char* caller){
+  StageTimer timer(Stats, "render");
+  Stats.count("plotsWritten");
+  if(!(bool)outDir.length()) outDir = ".";
+  this->checkDir(outDir);
+  TString figName = Form("%s/%s.%s",outDir.c_str(),c->GetName(),figType);
+
+  if(RenderWorkers){
+    //The queue file must not become gDirectory, histograms created later would attach to it
+    TDirectory::TContext context;
+    if(!RenderFile){
+      renderQueue = Form("%s/RatePlotter_render_%i.root", gSystem->TempDirectory(), gSystem->GetPid());
+      RenderFile  = TFile::Open(renderQueue.c_str(), "RECREATE");
+    }
+    TString key = Form("canvas_%i", (int)renderJobs.size());
+    RenderFile->WriteTObject(c, key);
+    renderJobs.push_back(std::make_pair(key, figName));
+    RP_DEBUG(caller, Form("Queued %s", figName.Data()));
+  }
+  else{
+    c->Print(figName);
+    INFO(caller, Form("Created %s", figName.Data()));
+  }
+
+  // Nothing is displayed in batch mode, so exported canvases are not kept alive, nor anything drawn on them
+  if(gROOT->IsBatch()){
+    this->releasePrimitives(c);
+    delete c;
+  }
+}
+
+void RatePlotter::releasePrimitives(TPad *pad){
+  //Primitives with kCanDelete are deleted with their pad. Every drawn object belongs to one plot,
+  //registry histograms are only drawn as clones; the frame is owned by the pad itself
+  TIter next(pad->GetListOfPrimitives());
+  TObject *obj(0);
+  while(( obj = next() )){
+    if(obj->InheritsFrom(TFrame::Class())) continue;
+    if(obj->InheritsFrom(TPad::Class())) this->releasePrimitives((TPad*)obj);
+    obj->SetBit(kCanDelete);
+  }
+}
+
+void RatePlotter::renderQueued(){
+  if(renderJobs.empty()) return;
+  StageTimer timer(Stats, "render");
+  RenderFile->Close();
+  delete RenderFile;
+  RenderFile = 0;
+
+  TString macro = Form("%s/renderCanvases.C", gSystem->GetDirName(__FILE__).Data());
+  if(gSystem->AccessPathName(macro)){
+    char *found = gSystem->Which(TROOT::GetMacroPath(), "renderCanvases.C");
+    macro = found ? found : "renderCanvases.C";
+    delete [] found;
+  }
+
+  //The macro call is one single-quoted shell word, its arguments are C strings inside it
+  auto quote = [](TString arg, bool cString){
+    if(cString){ arg.ReplaceAll("\\", "\\\\"); arg.ReplaceAll("\"", "\\\""); }
+    arg.ReplaceAll("'", "'\\''");
+    return arg;
+  };
+
+  //Figures of earlier runs are removed, so that only files written now count as rendered
+  for(auto job : renderJobs) gSystem->Unlink(job.second);
+
+  //Jobs are dealt round-robin so every worker gets a similar mix of 1D and 2D figures,
+  //the shell exits with the number of workers that failed
+  int nWorkers = std::min(RenderWorkers, (int)renderJobs.size());
+  std::vector<TString> lists(0);
+  TString cmd = "(";
+  for(int w(0); w<nWorkers; w++){
+    lists.push_back(Form("%s_%i.txt", renderQueue.c_str(), w));
+    std::ofstream list(lists.back().Data());
+    //One job per line, the key and the figure are separated by a tab: figure paths may hold spaces
+    for(unsigned int i(w); i<renderJobs.size(); i+=nWorkers)
+      list << renderJobs[i].first << "\t" << renderJobs[i].second << std::endl;
+    list.close();
+    cmd += Form(" root -l -b -q '%s(\"%s\",\"%s\",\"%s\")' > /dev/null 2>&1 & p%i=$!;", quote(macro,false).Data(), quote(renderQueue,true).Data(),
+		quote(lists.back(),true).Data(), quote(renderStyle,true).Data(), w);
+  }
+  cmd += " failed=0;";
+  for(int w(0); w<nWorkers; w++) cmd += Form(" wait $p%i || failed=$((failed+1));", w);
+  cmd += " exit $failed )";
+
+  RP_DEBUG("renderQueued", cmd.Data());
+  int status = gSystem->Exec(cmd);
+  if(status) INFO("renderQueued", Form("%i of %i render workers failed", WIFEXITED(status) ? WEXITSTATUS(status) : nWorkers, nWorkers));
+
+  int nRendered(0);
+  for(auto job : renderJobs){
+    if(gSystem->AccessPathName(job.second)) INFO("renderQueued", Form("Failed to create %s", job.second.Data()));
+    else{ INFO("renderQueued", Form("Created %s", job.second.Data())); nRendered++; }
+  }
+  INFO("renderQueued", Form("Rendered %i of %i figures with %i workers", nRendered, (int)renderJobs.size(), nWorkers));
+
+  for(auto list : lists) gSystem->Unlink(list);
+  gSystem->Unlink(renderQueue.c_str());
+  renderJobs.clear();
+}
+
 TFile *RatePlotter::findFile(const char* name){
   for(auto f : InFiles){
     if( (TString)name == (TString)f->GetName() ) return f;
@@ -88,45 +525,109 @@ void RatePlotter::setRatioRange(float min, float max){
   INFO("setRatioRange", Form("Set y(ratio) range to [%.2f|%.2f]",yRMin,yRMax));
 }
 
+void RatePlotter::setRecursiveSearch(bool rec){
+  Recursive = rec;
+  INFO("setRecursiveSearch", Form("Recursive file search %i",Recursive));
+}
+
+void RatePlotter::addFileFilter(const char* pattern, bool include){
+  fileFilters.push_back( std::make_pair((TString)pattern, include) );
+  INFO("addFileFilter", Form("%s files matching %s", include ? "Include" : "Exclude", pattern));
+}
+
+void RatePlotter::addFileClass(const char* pattern, const char* type){
+  TString t = type;
+  if(!(t=="Data" || t=="MC" || t=="Prompt" || t=="Skip")){
+    ERROR("addFileClass", Form("No valid file class %s. Please set [Data|MC|Prompt|Skip]", type));
+  }
+  fileClasses.push_back( std::make_pair((TString)pattern, t) );
+  INFO("addFileClass", Form("Files matching %s are %s", pattern, type));
+}
+
 void RatePlotter::getFiles(const char* dirname, const char* key1, const char* key2){
 
-  TString command = Form("ls -1 %s/*.root | sort &> filelist.txt",dirname);
-  if(strlen(key1) && !strlen(key2)) command = Form("ls -1 %s/*.root | sort | grep %s &> filelist.txt",dirname,key1);
-  if(strlen(key1) &&  strlen(key2)) command = Form("ls -1 %s/*.root | sort | grep %s | grep %s &> filelist.txt",dirname,key1,key2);
-  gSystem->Exec(command);
+  std::vector<std::string> files(0);
+  this->listFiles(dirname, files);
+  std::sort(files.begin(), files.end());
+  if(files.empty()){ INFO("getFiles", Form("No input files found in %s", dirname)); return; }
 
-  std::ifstream File;
-  File.open("filelist.txt");
-  if( !File.is_open() ){ INFO("addMCFiles", "No input list found"); return;}
-  while(true){
-    if( File.eof() ) break;
-    TString n;
-    File >> n;
-    if(!n.Contains(".root")) continue;
-    bool isDataFile = n.Contains("AllYear");
+  for(auto file : files){
+    TString n = file;
+    if(strlen(key1) && !TPRegexp(key1).MatchB(n)) continue;
+    if(strlen(key2) && !TPRegexp(key2).MatchB(n)) continue;
+    if(!this->passFileFilters(n)) continue;
+
+    TString type = this->classifyFile(n);
+    if(type=="Data")        this->addDataFile(n.Data());
+    else if(type=="MC")     this->addMCFile(n.Data());
+    else if(type=="Prompt") this->addPromptFile(n.Data());
+    else RP_DEBUG("getFiles", Form("Skipping file %s", n.Data()));
+  }
+}
+
+void RatePlotter::listFiles(const char* dirname, std::vector<std::string> &files){
+  void *dir = gSystem->OpenDirectory(dirname);
+  if(!dir){ INFO("getFiles", Form("Cannot open directory %s", dirname)); return; }
+
+  const char *entry(0);
+  while(( entry = gSystem->GetDirEntry(dir) )){
+    TString name = entry;
+    if(name.BeginsWith(".")) continue;
+
+    TString path = Form("%s/%s", dirname, name.Data());
+    FileStat_t stat;
+    if(gSystem->GetPathInfo(path, stat)) continue;
 
-    if(isDataFile) this->addDataFile(n.Data());
-    else this->addMCFile(n.Data());
+    if(R_ISDIR(stat.fMode)){
+      if(Recursive) this->listFiles(path, files);
+      continue;
+    }
+    if(name.EndsWith(".root")) files.push_back(path.Data());
+  }
+  gSystem->FreeDirectory(dir);
+}
+
+bool RatePlotter::passFileFilters(TString path){
+  if(fileFilters.empty()) return true;
+
+  TString name = gSystem->BaseName(path);
+  bool hasInclude(false), included(false);
+
+  for(auto filter : fileFilters){
+    TString pattern = filter.first;
+    bool match(false);
+    if(pattern.BeginsWith("re:")) match = TPRegexp(pattern(3, pattern.Length()-3)).MatchB(path);
+    else match = (name.Index(TRegexp(pattern, kTRUE)) != kNPOS);
+
+    if(!filter.second && match) return false;
+    if(filter.second){ hasInclude = true; included |= match; }
   }
-  gSystem->Exec("rm filelist.txt");
+  return !hasInclude || included;
+}
+
+TString RatePlotter::classifyFile(TString path){
+  for(auto fclass : fileClasses){
+    if(TPRegexp(fclass.first).MatchB(path)) return fclass.second;
+  }
+  return path.Contains("AllYear") ? "Data" : "MC";
 }
 
 void RatePlotter::addMCFile(const char* filename){
-  DEBUG("addFile", Form("Adding MC file %s",filename));
+  RP_DEBUG("addFile", Form("Adding MC file %s",filename));
   MCFiles.push_back(filename);
   MCRates = true;
   return;
 }
 
 void RatePlotter::addDataFile(const char* filename){
-  DEBUG("addFile", Form("Adding data file %s",filename));
+  RP_DEBUG("addFile", Form("Adding data file %s",filename));
   DataFiles.push_back(filename);
   DataRates = true;
   return;
 }
 
 void RatePlotter::addPromptFile(const char* filename){
-  DEBUG("addFile", Form("Adding prompt MC file %s",filename));
+  RP_DEBUG("addFile", Form("Adding prompt MC file %s",filename));
   PromptMCFiles.push_back(filename);
   Prompt = true;
   return;
@@ -150,90 +651,835 @@ std::vector<TGraphAsymmErrors*> RatePlotter::vec(TGraphAsymmErrors *g1, TGraphAs
   return v;
 }
 
-void RatePlotter::lumiScale(std::vector<TH1F*> histos){
+void RatePlotter::lumiScale(HistRegistry &histos){
   if(histos.empty()) return; 
-  for(auto h : histos) h->Scale(Lumi);
+  for(auto h : histos.list())   h->Scale(Lumi);
+  for(auto h : histos.list2D()) h->Scale(Lumi);
+  histos.setLazyScale(histos.getLazyScale()*Lumi);
   INFO("luminosityScale",Form("Scale histograms by %.1f",Lumi));
 }
 
-std::vector<TH1F*> RatePlotter::getHistosFromList(std::vector<std::string> filelist, const char* dirname){ 
+HistRegistry RatePlotter::getHistosFromList(std::vector<std::string> filelist, const char* dirname){ 
   if(filelist.empty()){ ERROR("getHistos", "No files selected"); }
-  
+  std::string dir = this->variationDir(dirname);
+  dirname = dir.c_str();
+  if(LazyLoad) return this->getKeysFromList(filelist, dirname);
+
+  auto region = regionHistos.find( this->getListKey(filelist, dirname).Data() );
+  if(region != regionHistos.end()){
+    RP_DEBUG("getHistos", Form("Using preloaded histograms for %s", dirname));
+    HistRegistry histos = this->copyHistos(region->second);
+    this->track(histos, "getHistosFromList");
+    this->addFakeKeys(histos);
+    return histos;
+  }
+
+  HistRegistry histos;
+  TString cacheKey = (UseCache && cacheDir.length()) ? this->getCacheKey(filelist, dirname) : "";
+  if(cacheKey.Length() && this->readCache(cacheKey, histos)){ this->track(histos, "getHistosFromList"); this->addFakeKeys(histos); return histos; }
+
+  if(NThreads>1 && filelist.size()>1) histos = this->getRegionHistos(filelist, {dirname}).front();
+  else histos = this->mergeHistos(filelist, dirname);
+
+  if(cacheKey.Length()) this->writeCache(cacheKey, histos);
+  this->track(histos, "getHistosFromList");
+  this->addFakeKeys(histos);
+  return histos;
+}
+
+void RatePlotter::addFakeKeys(HistRegistry &histos){
+  //The Fakes sums are only built when one of them is requested, see loadHisto
+  if(!FakeSourcesEl.empty()){
+    for(auto name : {"histoLoose_Fakes_electron0", "histoLoose_Fakes_electron1", "all_histoLoose_Fakes_electron",
+		     "histoTight_Fakes_electron0", "histoTight_Fakes_electron1", "all_histoTight_Fakes_electron"}) histos.addPending(name);
+  }
+  if(!FakeSourcesMu.empty()){
+    for(auto name : {"histoLoose_Fakes_muon0", "histoLoose_Fakes_muon1", "all_histoLoose_Fakes_muon",
+		     "histoTight_Fakes_muon0", "histoTight_Fakes_muon1", "all_histoTight_Fakes_muon"}) histos.addPending(name);
+  }
+}
+
+HistRegistry RatePlotter::mergeHistos(std::vector<std::string> filelist, const char* dirname){
   INFO("getHistos", Form("Retrieving histograms from %i files", (int)filelist.size()));
   const char* filename = filelist.at(0).c_str();
 
-  std::vector<TH1F*> histos = this->getHistos(filename, dirname);
+  HistRegistry histos = this->getHistos(filename, dirname);
   if(filelist.size()==1) return histos; 
   
   for(unsigned int i(1); i<filelist.size(); i++){
 
     const char* filename = filelist.at(i).c_str();
-    std::vector<TH1F*> histVec = this->getHistos(filename, dirname);
+    HistRegistry histVec = this->getHistos(filename, dirname);
+
+    std::vector<TString> onlyMerged(0), onlyFile(0);
+    histos.merge(histVec, onlyMerged, onlyFile);
 
-    for(unsigned int j(0); j<histVec.size(); j++) histos[j]->Add(histVec[j]); 
+    for(auto name : onlyMerged) INFO("getHistos", Form("Histogram %s missing in %s/%s, not merged for this file", name.Data(), filename, dirname));
+    for(auto name : onlyFile)   INFO("getHistos", Form("Histogram %s only found from %s/%s on, merged from this file", name.Data(), filename, dirname));
+
+    for(auto h : histVec.list()){   if(histos.find(h->GetName()) != h) delete h; }
+    for(auto h : histVec.list2D()){ if(histos.find2D(h->GetName()) != h) delete h; }
   }
   return histos;
 }
 
-std::vector<TH1F*> RatePlotter::getHistos(const char* filename, const char* dirname){
-  TDirectory *d(0);
-  TFile *file = this->findFile(filename);
-  
-  if(!file){ 
-    file = new TFile(filename); 
-    if(file->IsZombie()){ ERROR("getHistos", Form("Failed to open: %s", filename));}
+TString RatePlotter::getCacheKey(const std::vector<std::string> &filelist, const char* dirname){
+  TString key = Form("v3;%s;", dirname);
 
-    d = (TDirectory*)file->Get(dirname);
-    if(d->IsZombie()){ ERROR("getHistos", Form("Failed to open: %s/%s", filename,dirname));}
+  for(auto filename : filelist){
+    FileStat_t stat;
+    if(gSystem->GetPathInfo(filename.c_str(), stat)){ INFO("getCacheKey", Form("No file info for %s, input cache not used", filename.c_str())); return ""; }
+    key += Form("%s:%lld:%ld;", filename.c_str(), (long long)stat.fSize, (long)stat.fMtime);
+  }
+  TMD5 md5;
+  md5.Update((const UChar_t*)key.Data(), key.Length());
+  md5.Final();
+  return md5.AsString();
+}
 
-    INFO("getHistos", Form("Opened: %s/%s", file->GetName(), d->GetName()));
-    InFiles.push_back(file);
+bool RatePlotter::readCache(TString key, HistRegistry &histos){
+  TString filename = Form("%s/%s.root", cacheDir.c_str(), key.Data());
+  if(gSystem->AccessPathName(filename)) return false;
+  StageTimer timer(Stats, "readCache");
+
+  TDirectory::TContext context;
+  TFile *f = TFile::Open(filename);
+  if(!f || f->IsZombie()){ INFO("readCache", Form("Corrupt cache file %s, rebuilding", filename.Data())); delete f; return false; }
+
+  TList *l = (TList*)f->Get("histos");
+  if(!l){ delete f; return false; }
+
+  TIter next(l);
+  TObject *obj(0);
+  while(( obj = next() )){
+    TH1 *h = (TH1*)obj;
+    h->SetDirectory(0);
+    if(h->GetDimension()==2) histos.add((TH2F*)h);
+    else histos.add((TH1F*)h);
   }
-  if(!d) d = (TDirectory*)file->Get(dirname);
+  delete l;
+  Stats.count("bytesRead", f->GetBytesRead());
+  delete f;
+  INFO("getHistos", Form("Read %i histograms from cache %s", (int)histos.size(), filename.Data()));
+  return true;
+}
+
+void RatePlotter::writeCache(TString key, const HistRegistry &histos){
+  TString filename = Form("%s/%s.root", cacheDir.c_str(), key.Data());
+  TString tmpname  = Form("%s.%s.%i.tmp", filename.Data(), gSystem->HostName(), gSystem->GetPid());
+
+  TDirectory::TContext context;
+  TFile *f = TFile::Open(tmpname, "RECREATE");
+  if(!f || f->IsZombie()){ INFO("writeCache", Form("Cannot write cache file %s", tmpname.Data())); delete f; return; }
+
+  TList l;
+  for(auto h : histos.list())   l.Add(h);
+  for(auto h : histos.list2D()) l.Add(h);
+  l.Write("histos", TObject::kSingleKey);
+  f->Close();
+  delete f;
+
+  //Rename is atomic, concurrent jobs never see a partially written cache file
+  if(gSystem->Rename(tmpname, filename)) gSystem->Unlink(tmpname);
+  else INFO("writeCache", Form("Wrote %i histograms to cache %s", (int)histos.size(), filename.Data()));
+}
+
+HistRegistry RatePlotter::getKeysFromList(std::vector<std::string> filelist, const char* dirname){
+  INFO("getHistos", Form("Indexing histograms from %i files (lazy)", (int)filelist.size()));
+
+  HistRegistry histos;
+  histos.setSource(filelist, dirname);
+
+  for(auto filename : filelist){
+    TFile *file = this->openFile(filename.c_str(), dirname);
+    TDirectory *d = (TDirectory*)file->Get(dirname);
+
+    TKey *key(0);
+    TList* Objects = d->GetListOfKeys();
+    Objects->Sort();
+
+    TIter next(Objects);
+    while(( key = (TKey*)next() )){
+      TClass *cl = TClass::GetClass(key->GetClassName());
+      if(!cl || !(cl->InheritsFrom("TH1F") || cl->InheritsFrom("TH2F"))) continue;
+      histos.addPending(key->GetName());
+    }
+    this->releaseFile(file);
+  }
+  this->addFakeKeys(histos);
+  RP_DEBUG("getHistos", Form("Indexed %i histograms in %s", (int)histos.names().size(), dirname));
+
+  if(!prefetchNames.empty()) this->prefetchHistos(histos, prefetchNames);
+  return histos;
+}
+
+TFile* RatePlotter::openFile(const char* filename, const char* dirname){
+  TFile *file = this->findFile(filename);
+  if(file) return file;
+
+  StageTimer timer(Stats, "fileOpen");
+  Stats.count("filesOpened");
+  //Keep gDirectory: clones made while reading must not attach to, and die with, the input file
+  TDirectory::TContext context;
+  file = new TFile(filename); 
+  if(file->IsZombie()){ ERROR("getHistos", Form("Failed to open: %s", filename));}
+
+  TDirectory *d = (TDirectory*)file->Get(dirname);
+  if(!d || d->IsZombie()){ ERROR("getHistos", Form("Failed to open: %s/%s", filename,dirname));}
+
+  INFO("getHistos", Form("Opened: %s/%s", file->GetName(), d->GetName()));
+  InFiles.push_back(file);
+  return file;
+}
+
+void RatePlotter::releaseFile(TFile *file){
+  if(!Streaming || !file) return;
+  InFiles.erase(std::remove(InFiles.begin(), InFiles.end(), file), InFiles.end());
+  this->countBytesRead(file, true);
+  file->Close();
+  delete file;
+}
 
-  float scale = getMCNorm(file);
-  std::vector<TH1F*> hVec(0);
+HistRegistry RatePlotter::getHistos(const char* filename, const char* dirname){
+  TFile *file = this->openFile(filename, dirname);
+  TDirectory *d = (TDirectory*)file->Get(dirname);
 
+  HistRegistry hVec = this->readHistos(d, getMCNorm(file));
+  this->releaseFile(file);
+  RP_DEBUG("getHistos",Form("Retrieved %i histograms from file",(int)hVec.size()));
+  return hVec;
+}
+
+HistRegistry RatePlotter::readHistos(TDirectory *d, float scale){
+  HistRegistry hVec;
+
+  StageTimer timer(Stats, "readKeys");
   TKey *key(0);
   TList* Objects = d->GetListOfKeys();
   Objects->Sort();
 
   TIter next(Objects);
   while(( key = (TKey*)next() )){
-    TObject *obj = key->ReadObj();                                                
-    if (!obj->IsA()->InheritsFrom("TH1F")) continue;
-    TH1F *hist = (TH1F*)obj;
+    TClass *cl = TClass::GetClass(key->GetClassName());
+    bool is2D = cl && cl->InheritsFrom("TH2F");
+    if(!cl || !(cl->InheritsFrom("TH1F") || is2D)) continue;
+    if(hVec.contains(key->GetName())){ RP_DEBUG("getHistos", Form("Skipping duplicate key %s;%i", key->GetName(), (int)key->GetCycle())); continue; }
+
+    Stats.count("histsRead");
+    TH1 *hist = (TH1*)key->ReadObj();
+    hist->SetDirectory(0);
     hist->Scale(scale);
-    hVec.push_back(hist);
+    if(is2D) hVec.add((TH2F*)hist);
+    else hVec.add((TH1F*)hist);
   }
+  return hVec;
+}
 
-  if(!FakeSourcesEl.empty()) this->addFakeHist(hVec, "El");
-  if(!FakeSourcesMu.empty()) this->addFakeHist(hVec, "Mu");
+void RatePlotter::loadRegions(std::vector<std::string> dirnames){
+  if(dirnames.empty()){ INFO("loadRegions", "No directories selected"); return; }
 
-  DEBUG("getHistos",Form("Retrieved %i histograms from file",(int)hVec.size()));
-  return hVec;
+  std::vector< std::vector<std::string> > filelists = {MCFiles, DataFiles, PromptMCFiles};
+  for(auto filelist : filelists){
+    if(filelist.empty()) continue;
+    this->loadRegions(filelist, dirnames);
+  }
+}
+
+void RatePlotter::loadRegions(std::vector<std::string> filelist, std::vector<std::string> dirnames){
+  //Directories already in memory for this file list are not read again
+  dirnames.erase(std::remove_if(dirnames.begin(), dirnames.end(), [&](const std::string &d){
+	return regionHistos.count( this->getListKey(filelist, d.c_str()).Data() ) > 0; }), dirnames.end());
+  if(filelist.empty() || dirnames.empty()) return;
+
+  INFO("loadRegions", Form("Reading %i directories from %i files in one pass", (int)dirnames.size(), (int)filelist.size()));
+  std::vector<HistRegistry> sums = this->getRegionHistos(filelist, dirnames);
+
+  for(unsigned int i(0); i<dirnames.size(); i++){
+    const char* dirname = dirnames[i].c_str();
+    regionHistos[ this->getListKey(filelist, dirname).Data() ] = sums[i];
+
+    TString cacheKey = (UseCache && cacheDir.length()) ? this->getCacheKey(filelist, dirname) : "";
+    if(cacheKey.Length()) this->writeCache(cacheKey, sums[i]);
+  }
+}
+
+SysVariation& RatePlotter::getVariation(const char* name){
+  for(auto &var : variations){ if(var.name == name) return var; }
+  variations.push_back(SysVariation(name));
+  return variations.back();
+}
+
+void RatePlotter::addVariation(const char* name){
+  if(TString(name).Contains("__") || !strlen(name)){ INFO("addVariation", Form("Invalid variation name '%s'", name)); return; }
+  this->getVariation(name);
+  INFO("addVariation", Form("Systematic variation %s", name));
+}
+
+void RatePlotter::setVariationDirectory(const char* name, const char* from, const char* to){
+  SysVariation &var = this->getVariation(name);
+  var.dirFrom = from;
+  var.dirTo   = to;
+  INFO("setVariationDirectory", Form("Variation %s: directories with '%s' replaced by '%s'", name, from, to));
+}
+
+void RatePlotter::setVariationProcessSF(const char* name, TString proc, float sf){
+  this->getVariation(name).procSF.push_back( std::make_pair(proc, sf) );
+  INFO("setVariationProcessSF", Form("Variation %s: %s subtracted with SF=%.2f", name, proc.Data(), sf));
+}
+
+void RatePlotter::setVariationFiles(const char* name, const char* dirname, const char* key1, const char* key2){
+  //getFiles fills the nominal lists, which are restored afterwards
+  std::vector<std::string> mc(MCFiles), data(DataFiles), prompt(PromptMCFiles);
+  bool mcRates(MCRates), dataRates(DataRates), hasPrompt(Prompt);
+  MCFiles.clear(); DataFiles.clear(); PromptMCFiles.clear();
+
+  this->getFiles(dirname, key1, key2);
+  SysVariation &var = this->getVariation(name);
+  var.mcFiles     = MCFiles;
+  var.dataFiles   = DataFiles;
+  var.promptFiles = PromptMCFiles;
+
+  MCFiles = mc; DataFiles = data; PromptMCFiles = prompt;
+  MCRates = mcRates; DataRates = dataRates; Prompt = hasPrompt;
+  INFO("setVariationFiles", Form("Variation %s: %i MC, %i data and %i prompt MC files from %s", name, (int)var.mcFiles.size(), (int)var.dataFiles.size(), (int)var.promptFiles.size(), dirname));
+}
+
+void RatePlotter::setVariationLumi(const char* name, float lumi){
+  this->getVariation(name).lumi = lumi;
+  INFO("setVariationLumi", Form("Variation %s: lumi scale %.1f", name, lumi));
+}
+
+std::string RatePlotter::variationDir(const char* dirname){
+  if(!activeVar || !activeVar->dirTo.length()) return dirname;
+  if(!activeVar->dirFrom.length()) return activeVar->dirTo;
+  TString dir = dirname;
+  dir.ReplaceAll(activeVar->dirFrom.c_str(), activeVar->dirTo.c_str());
+  return dir.Data();
+}
+
+void RatePlotter::addVariationGroup(const char* pattern, const char* group, bool envelope){
+  VariationGroup rule;
+  rule.pattern  = pattern;
+  rule.name     = group;
+  rule.envelope = envelope;
+  variationGroups.push_back(rule);
+  INFO("addVariationGroup", Form("Variations matching %s form group %s (%s)", pattern, group, envelope ? "envelope" : "correlated"));
+}
+
+void RatePlotter::combineVariations(const char* path, bool subtracted){
+  std::vector<std::string> files(0);
+  FileStat_t stat;
+  if(!gSystem->GetPathInfo(path, stat) && R_ISDIR(stat.fMode)){
+    //Output directories hold one subdirectory per region
+    bool recursive(Recursive);
+    Recursive = true;
+    this->listFiles(path, files);
+    Recursive = recursive;
+    TString prefix = (outFile && strlen(outFile)) ? outFile : "";
+    files.erase(std::remove_if(files.begin(), files.end(), [&](const std::string &f){
+	  return !TString(gSystem->BaseName(f.c_str())).BeginsWith(prefix); }), files.end());
+  }
+  else files.push_back(path);
+
+  if(files.empty()){ INFO("combineVariations", Form("No output files found in %s", path)); return; }
+  for(auto filename : files) this->combineVariationFile(filename, subtracted);
+}
+
+void RatePlotter::combineVariationFile(const std::string& filename, bool subtracted){
+  StageTimer timer(Stats, "combineVariations");
+  Writer.flush();
+
+  //Per nominal histogram: squared up/down shifts of single variations and the shifts per group
+  struct Combination {
+    TH1 *nom;
+    int nVar;
+    std::vector<double> up2, down2;
+    std::map< std::string, std::vector<double> > grpUp, grpDown;
+  };
+  std::map<std::string, Combination> combs;
+  std::vector<TH1*> results(0);
+  int nRead(0);
+  {
+    std::lock_guard<std::mutex> guard(Writer.fileMutex());
+    TFile *f = Writer.open(filename);
+    if(!f){ INFO("combineVariations", Form("Cannot open %s", filename.c_str())); return; }
+
+    //Highest cycle per name, a nominal sorts before its own "__suffix" variations
+    std::map<std::string, TKey*> keys = latestKeys(f);
+
+    std::map<std::string, int> groupOf;
+    for(auto &k : keys){
+      TString name = k.first;
+      if(name.Contains("__TOTAL") || isCovariance(name)) continue;
+      int pos = name.Index("__");
+      TString base = (pos<0) ? name : TString(name(0,pos));
+
+      TH1 *h = (TH1*)k.second->ReadObj();
+      h->SetDirectory(0);
+      Stats.count("histsRead");
+      nRead++;
+
+      int n = h->GetNcells();
+      if(pos<0){
+	Combination &c = combs[k.first];
+	c.nom  = h;
+	c.nVar = 0;
+	c.up2.assign(n, 0.);
+	c.down2.assign(n, 0.);
+	continue;
+      }
+      auto comb = combs.find(base.Data());
+      if(comb == combs.end() || comb->second.up2.size() != (unsigned int)n){
+	INFO("combineVariations", Form("No matching nominal histogram for %s in %s", name.Data(), filename.c_str()));
+	delete h;
+	continue;
+      }
+      Combination &c = comb->second;
+      c.nVar++;
+
+      //Group rules are evaluated once per suffix
+      std::string suffix = TString(name(pos+2, name.Length()-pos-2)).Data();
+      if(!groupOf.count(suffix)){
+	groupOf[suffix] = -1;
+	for(unsigned int g(0); g<variationGroups.size(); g++){
+	  if(TPRegexp(variationGroups[g].pattern).MatchB(suffix.c_str())){ groupOf[suffix] = g; break; }
+	}
+      }
+      const VariationGroup *grp = (groupOf[suffix]<0) ? 0 : &variationGroups[groupOf[suffix]];
+      if(grp && c.grpUp[grp->name].empty()){ c.grpUp[grp->name].assign(n, 0.); c.grpDown[grp->name].assign(n, 0.); }
+
+      for(int b(0); b<n; b++){
+	double d = subtracted ? std::fabs(h->GetBinContent(b)) : h->GetBinContent(b) - c.nom->GetBinContent(b);
+	double up = d>0. ? d : 0., down = subtracted ? up : (d<0. ? -d : 0.);
+	if(!grp){
+	  c.up2[b]   += up*up;
+	  c.down2[b] += down*down;
+	}
+	else if(grp->envelope){
+	  c.grpUp[grp->name][b]   = std::max(c.grpUp[grp->name][b], up);
+	  c.grpDown[grp->name][b] = std::max(c.grpDown[grp->name][b], down);
+	}
+	else{
+	  //Correlated shifts add linearly, with their sign for raw variations
+	  c.grpUp[grp->name][b] += subtracted ? up : d;
+	}
+      }
+      delete h;
+    }
+  }
+
+  for(auto &comb : combs){
+    Combination &c = comb.second;
+    if(c.nVar){
+      for(auto &grp : c.grpUp){
+	bool envelope(false);
+	for(auto &rule : variationGroups){ if(rule.name == grp.first) envelope = rule.envelope; }
+	std::vector<double> &gd = c.grpDown[grp.first];
+	for(unsigned int b(0); b<c.up2.size(); b++){
+	  double up   = envelope ? grp.second[b] : (subtracted ? grp.second[b] : std::max(grp.second[b], 0.));
+	  double down = envelope ? gd[b]         : (subtracted ? grp.second[b] : std::max(-grp.second[b], 0.));
+	  c.up2[b]   += up*up;
+	  c.down2[b] += down*down;
+	}
+      }
+
+      TH1 *hTot  = (TH1*)c.nom->Clone(Form("%s__TOTAL",     comb.first.c_str()));
+      TH1 *hUp   = (TH1*)c.nom->Clone(Form("%s__TOTALUP",   comb.first.c_str()));
+      TH1 *hDown = (TH1*)c.nom->Clone(Form("%s__TOTALDOWN", comb.first.c_str()));
+      for(auto h : {hTot, hUp, hDown}){ h->SetDirectory(0); h->Reset(); }
+      for(unsigned int b(0); b<c.up2.size(); b++){
+	double nom = c.nom->GetBinContent(b), up = std::sqrt(c.up2[b]), down = std::sqrt(c.down2[b]);
+	hTot->SetBinContent(b, std::max(up, down));
+	hUp->SetBinContent(b, nom + up);
+	hDown->SetBinContent(b, std::max(nom - down, 0.));
+      }
+      results.push_back(hTot);
+      results.push_back(hUp);
+      results.push_back(hDown);
+      RP_DEBUG("combineVariations", Form("%s: %i variations, %i groups", comb.first.c_str(), c.nVar, (int)c.grpUp.size()));
+    }
+    delete c.nom;
+  }
+  for(auto h : results) Writer.queue(filename, h);
+  INFO("combineVariations", Form("Combined %i nominal histograms from %i keys of %s", (int)results.size()/3, nRead, filename.c_str()));
+}
+
+void RatePlotter::runVariations(std::function<void()> job, std::vector<std::string> dirnames){
+  if(!job){ INFO("runVariations", "No job given"); return; }
+
+  //Shared inputs: every file list is read once, in one pass over all directories it is needed for
+  std::map< std::vector<std::string>, std::vector<std::string> > inputs;
+  std::vector<SysVariation*> setups(1, (SysVariation*)0);
+  for(auto &var : variations) setups.push_back(&var);
+  for(auto setup : setups){
+    activeVar = setup;
+    std::vector< std::vector<std::string> > filelists = {MCFiles, DataFiles, PromptMCFiles};
+    if(setup && !setup->mcFiles.empty())     filelists[0] = setup->mcFiles;
+    if(setup && !setup->dataFiles.empty())   filelists[1] = setup->dataFiles;
+    if(setup && !setup->promptFiles.empty()) filelists[2] = setup->promptFiles;
+
+    for(auto filelist : filelists){
+      if(filelist.empty()) continue;
+      std::vector<std::string> &dirs = inputs[filelist];
+      for(auto dirname : dirnames){
+	std::string dir = this->variationDir(dirname.c_str());
+	if(std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) dirs.push_back(dir);
+      }
+    }
+  }
+  activeVar = 0;
+  for(auto input : inputs) this->loadRegions(input.first, input.second);
+
+  INFO("runVariations", Form("Nominal and %i variations from %i input file lists", (int)variations.size(), (int)inputs.size()));
+  job();
+
+  std::string nomSuffix(sysSuffix);
+  std::vector<std::string> mc(MCFiles), data(DataFiles), prompt(PromptMCFiles);
+  bool mcRates(MCRates), dataRates(DataRates), hasPrompt(Prompt);
+  std::vector<float> procSF(subtractedProcSF);
+  float lumi(Lumi);
+
+  for(auto &var : variations){
+    INFO("runVariations", Form("Variation %s", var.name.c_str()));
+    activeVar = &var;
+    sysSuffix = var.name;
+    if(!var.mcFiles.empty())     { MCFiles = var.mcFiles;         MCRates = true; }
+    if(!var.dataFiles.empty())   { DataFiles = var.dataFiles;     DataRates = true; }
+    if(!var.promptFiles.empty()) { PromptMCFiles = var.promptFiles; Prompt = true; }
+    if(var.lumi > 0) Lumi = var.lumi;
+    for(auto sf : var.procSF){
+      for(unsigned int i(0); i<subtractedProc.size(); i++){ if(subtractedProc[i] == sf.first) subtractedProcSF[i] = sf.second; }
+    }
+
+    job();
+
+    activeVar = 0;
+    sysSuffix = nomSuffix;
+    MCFiles = mc; DataFiles = data; PromptMCFiles = prompt;
+    MCRates = mcRates; DataRates = dataRates; Prompt = hasPrompt;
+    subtractedProcSF = procSF;
+    Lumi = lumi;
+  }
+}
+
+TString RatePlotter::getListKey(const std::vector<std::string> &filelist, const char* dirname){
+  TString key = dirname;
+  for(auto filename : filelist) key += Form(";%s", filename.c_str());
+
+  TMD5 md5;
+  md5.Update((const UChar_t*)key.Data(), key.Length());
+  md5.Final();
+  return md5.AsString();
+}
+
+HistRegistry RatePlotter::copyHistos(const HistRegistry &histos){
+  HistRegistry hCopy;
+  for(auto h : histos.list()){
+    TH1F *hist = (TH1F*)h->Clone();
+    hist->SetDirectory(0);
+    hCopy.add(hist);
+  }
+  for(auto h : histos.list2D()){
+    TH2F *hist = (TH2F*)h->Clone();
+    hist->SetDirectory(0);
+    hCopy.add(hist);
+  }
+  return hCopy;
+}
+
+std::vector<HistRegistry> RatePlotter::getRegionHistos(std::vector<std::string> filelist, std::vector<std::string> dirnames){
+  int nWorkers = std::max(1, std::min(NThreads, (int)filelist.size()));
+  INFO("getHistos", Form("Merging %i files with %i threads", (int)filelist.size(), nWorkers));
+
+  std::vector< std::vector<HistRegistry> > sums(nWorkers, std::vector<HistRegistry>(dirnames.size()));
+  std::vector< std::vector<TString> > messages(nWorkers), failures(nWorkers);
+  std::vector<std::thread> workers(0);
+
+  for(int t(0); t<nWorkers; t++){
+    std::vector<std::string> subset(filelist.begin() + t*filelist.size()/nWorkers,
+				    filelist.begin() + (t+1)*filelist.size()/nWorkers);
+    if(nWorkers==1){ this->mergeFiles(subset, dirnames, sums[t], messages[t], failures[t]); break; }
+    workers.push_back( std::thread(&RatePlotter::mergeFiles, this, subset, dirnames, std::ref(sums[t]), std::ref(messages[t]), std::ref(failures[t])) );
+  }
+  for(auto &w : workers) w.join();
+
+  //A file the serial merge stops on fails the threaded merge too, before anything is summed or cached
+  for(auto fails : failures){ for(auto msg : fails) ERROR("getHistos", msg.Data()); }
+
+  //Pairwise tree reduction of the per-thread sums, keeping the file order of the serial merge
+  for(int step(1); step<nWorkers; step*=2){
+    workers.clear();
+    for(int t(0); t+step<nWorkers; t+=2*step){
+      workers.push_back( std::thread([&sums, &messages, &dirnames, t, step](){
+	    for(unsigned int i(0); i<dirnames.size(); i++){
+	      std::vector<TString> onlyHere(0), onlyOther(0);
+	      sums[t][i].merge(sums[t+step][i], onlyHere, onlyOther);
+	      for(auto name : onlyHere)  messages[t].push_back(Form("Histogram %s/%s missing in later files, not merged for these", dirnames[i].c_str(), name.Data()));
+	      for(auto name : onlyOther) messages[t].push_back(Form("Histogram %s/%s missing in earlier files, merged from later files", dirnames[i].c_str(), name.Data()));
+
+	      for(auto h : sums[t+step][i].list()){   if(sums[t][i].find(h->GetName()) != h) delete h; }
+	      for(auto h : sums[t+step][i].list2D()){ if(sums[t][i].find2D(h->GetName()) != h) delete h; }
+	    }
+	  }) );
+    }
+    for(auto &w : workers) w.join();
+  }
+  for(auto msgs : messages){ for(auto msg : msgs) INFO("getHistos", msg.Data()); }
+  return sums.front();
+}
+
+void RatePlotter::mergeFiles(std::vector<std::string> filelist, std::vector<std::string> dirnames, std::vector<HistRegistry> &histos, std::vector<TString> &messages, std::vector<TString> &failures){
+  TDirectory::TContext context(nullptr);
+
+  for(auto filename : filelist){
+    TFile *file(0);
+    {
+      StageTimer timer(Stats, "fileOpen");
+      Stats.count("filesOpened");
+      file = TFile::Open(filename.c_str());
+    }
+    if(!file || file->IsZombie()){ failures.push_back(Form("Failed to open: %s", filename.c_str())); delete file; return; }
+    //getMCNorm exits on a missing normalisation, which must not happen inside a worker thread: the failure is reported after the join
+    if(!file->GetKey("MCLumiHist")){
+      failures.push_back(Form("No normalization histogram found in file %s", filename.c_str()));
+      delete file;
+      return;
+    }
+    float scale = getMCNorm(file);
+
+    for(unsigned int i(0); i<dirnames.size(); i++){
+      const char* dirname = dirnames[i].c_str();
+      TDirectory *d = (TDirectory*)file->Get(dirname);
+      if(!d){ failures.push_back(Form("Failed to open: %s/%s", filename.c_str(), dirname)); delete file; return; }
+
+      HistRegistry histVec = this->readHistos(d, scale);
+      if(histos[i].empty()){ histos[i] = histVec; continue; }
+
+      std::vector<TString> onlyMerged(0), onlyFile(0);
+      histos[i].merge(histVec, onlyMerged, onlyFile);
+      for(auto name : onlyMerged) messages.push_back(Form("Histogram %s missing in %s/%s, not merged for this file", name.Data(), filename.c_str(), dirname));
+      for(auto name : onlyFile)   messages.push_back(Form("Histogram %s only found from %s/%s on, merged from this file", name.Data(), filename.c_str(), dirname));
+
+      for(auto h : histVec.list()){   if(histos[i].find(h->GetName()) != h) delete h; }
+      for(auto h : histVec.list2D()){ if(histos[i].find2D(h->GetName()) != h) delete h; }
+    }
+    Stats.count("bytesRead", file->GetBytesRead());
+    delete file;
+  }
+}
+
+TH1F* RatePlotter::findHisto(TString name, HistRegistry &histos){
+  TH1F *h = histos.find(name);
+  if(!h && histos.isPending(name)) h = dynamic_cast<TH1F*>(this->loadHisto(name, histos));
+  if(h) return h;
+  INFO("findHisto", Form("Histogram %s not found", name.Data()));
+  return nullptr;
 }
 
-TH1F* RatePlotter::findHisto(TString name, std::vector<TH1F*> histos){
-  for (auto h : histos)
-    if(h->GetName()==name) return h;
+TH2F* RatePlotter::findHisto2D(TString name, HistRegistry &histos){
+  TH2F *h = histos.find2D(name);
+  if(!h && histos.isPending(name)) h = dynamic_cast<TH2F*>(this->loadHisto(name, histos));
+  if(h) return h;
   INFO("findHisto", Form("Histogram %s not found", name.Data()));
   return nullptr;
 }
 
+void RatePlotter::prefetchHistos(HistRegistry &histos, std::vector<TString> names){
+  int nRead(0);
+  for(auto name : names){
+    if(!histos.isPending(name)) continue;
+    if(this->loadHisto(name, histos)) nRead++;
+  }
+  INFO("prefetchHistos", Form("Read %i of %i requested histograms from %s", nRead, (int)names.size(), histos.getSourceDir()));
+}
+
+TH1* RatePlotter::loadHisto(TString name, HistRegistry &histos){
+  if(!histos.isPending(name)) return histos.contains(name) ? (TH1*)histos.find(name) : nullptr;
+
+  //The Fakes of a flavor are summed once from the scaled and subtracted inputs, see readMergedFakes
+  if(this->histKey(name).source=="Fakes") return this->readMergedFakes(name, histos);
+  if(histos.getSourceFiles().empty()) return nullptr;
+
+  TH1 *h = this->readMerged(name, histos.getSourceFiles(), histos.getSourceDir());
+  if(!h) return h;
+
+  if(histos.getLazyScale() != 1.) h->Scale(histos.getLazyScale());
+  for(auto &sub : histos.getLazySubtractions()){
+    TH1 *hSub = (h->GetDimension()==2) ? (TH1*)findHisto2D(name, sub) : (TH1*)findHisto(name, sub);
+    this->subtract(h, hSub);
+  }
+
+  if(h->GetDimension()==2) histos.add((TH2F*)h);
+  else histos.add((TH1F*)h);
+  this->track(h, "loadHisto");
+  RP_DEBUG("loadHisto", Form("Read %s from %i files", name.Data(), (int)histos.getSourceFiles().size()));
+  return h;
+}
+
+TH1* RatePlotter::readMerged(TString name, const std::vector<std::string> &filelist, const char* dirname){
+  TH1 *hSum(0);
+  for(auto filename : filelist){
+    TFile *file = this->openFile(filename.c_str(), dirname);
+    TDirectory *d = (TDirectory*)file->Get(dirname);
+
+    TKey *key = d->GetKey(name);
+    if(!key){ INFO("readMerged", Form("Histogram %s missing in %s/%s, not merged for this file", name.Data(), filename.c_str(), dirname)); this->releaseFile(file); continue; }
+
+    TH1 *h(0);
+    {
+      StageTimer timer(Stats, "readKeys");
+      Stats.count("histsRead");
+      h = (TH1*)key->ReadObj();
+    }
+    h->SetDirectory(0);
+    h->Scale(getMCNorm(file));
+    this->releaseFile(file);
+
+    if(!hSum){ hSum = h; continue; }
+    hSum->Add(h);
+    delete h;
+  }
+  return hSum;
+}
+
+TH1F* RatePlotter::readMergedFakes(TString name, HistRegistry &histos){
+  int flavor  = this->histKey(name).flavor;
+  TString opt = (flavor==HistKey::Muon) ? "Mu" : "El";
+  const std::vector<TString> &sources = (opt=="Mu") ? FakeSourcesMu : FakeSourcesEl;
+
+  //Inclusive templates and fake sources of the flavor are read once into the registry, those already there are reused
+  std::vector<TString> names = histos.names();
+  std::vector<HistKey> keys  = histos.histKeys();
+  for(unsigned int i(0); i<keys.size(); i++){
+    const HistKey &key = keys[i];
+    if(key.dim!=1 || key.slot()<0 || key.flavor!=flavor || key.source=="Fakes") continue;
+    bool needed = key.inclusive() || std::find(sources.begin(), sources.end(), key.source) != sources.end();
+    if(needed && histos.isPending(names[i])) this->loadHisto(names[i], histos);
+  }
+
+  //All six sums of the flavor are added, so none of them is built again
+  unsigned int nBefore = histos.list().size();
+  this->addFakeHist(histos, opt);
+  for(unsigned int i(nBefore); i<histos.list().size(); i++) this->track(histos.list()[i], "loadHisto");
+  RP_DEBUG("loadHisto", Form("Summed the %s Fakes histograms for %s", opt.Data(), name.Data()));
+  return histos.find(name);
+}
+
+bool HistRegistry::add(TH1F* h){
+  if(!h) return false;
+  if(index2D.count(h->GetName())) return false;
+  if(!index.emplace(h->GetName(), histos.size()).second) return false;
+  histos.push_back(h);
+  addPending(h->GetName());
+  return true;
+}
+
+bool HistRegistry::add(TH2F* h){
+  if(!h) return false;
+  if(index.count(h->GetName())) return false;
+  if(!index2D.emplace(h->GetName(), histos2D.size()).second) return false;
+  histos2D.push_back(h);
+  addPending(h->GetName());
+  return true;
+}
+
+void HistRegistry::deleteAll(){
+  for(auto h : histos)   delete h;
+  for(auto h : histos2D) delete h;
+  clear();
+}
+
+void HistRegistry::addPending(const TString& name){
+  if(!known.emplace(name.Data(), true).second) return;
+  keys.push_back(name);
+  parsed.push_back(HistKey::parse(name));
+}
+
+HistKey HistKey::parse(const TString& fullName){
+  HistKey key;
+  int start = fullName.Index("histo");
+  if(start<0) return key;
+  key.all = start>=4 && TString(fullName(start-4,4))=="all_";
+
+  //Only the first input name of a derived name is described
+  TString name = fullName(start, fullName.Length()-start);
+  for(auto cut : {"__", "_over_", "_all_histo", "_histo"}){
+    int pos = name.Index(cut);
+    if(pos>0) name.Resize(pos);
+  }
+
+  key.dim = name.BeginsWith("histo2D_") ? 2 : 1;
+  name.Remove(0, key.dim==2 ? 8 : 5);
+  if(name.BeginsWith("Loose_"))      key.quality = Loose;
+  else if(name.BeginsWith("Tight_")) key.quality = Tight;
+  else return HistKey();
+  name.Remove(0,6);
+
+  if(key.dim==1 && !key.all && name.Length() && isdigit(name[name.Length()-1])){
+    key.axis = name[name.Length()-1] - '0';
+    name.Resize(name.Length()-1);
+  }
+  if(name=="el" || name=="mu") key.flavor = (name=="el") ? Electron : Muon;
+  else if(name.EndsWith("_electron")){ key.flavor = Electron; key.source = name(0, name.Length()-9); }
+  else if(name.EndsWith("_muon")){     key.flavor = Muon;     key.source = name(0, name.Length()-5); }
+  else{
+    key.source = name;
+    if(electronOnly(name)) key.flavor = Electron;
+  }
+  if(!name.Length()) return HistKey();
+  return key;
+}
+
+const HistKey& RatePlotter::histKey(const TString& name){
+  auto it = keyCache.find(name.Data());
+  if(it != keyCache.end()) return it->second;
+  return keyCache.emplace(name.Data(), HistKey::parse(name)).first->second;
+}
+
+TH1F* HistRegistry::find(const TString& name) const{
+  auto it = index.find(name.Data());
+  if(it == index.end()) return nullptr;
+  return histos[it->second];
+}
+
+TH2F* HistRegistry::find2D(const TString& name) const{
+  auto it = index2D.find(name.Data());
+  if(it == index2D.end()) return nullptr;
+  return histos2D[it->second];
+}
+
+void HistRegistry::merge(const HistRegistry& other, std::vector<TString> &onlyHere, std::vector<TString> &onlyOther){
+  for(auto h : histos){   if(!other.contains(h->GetName())) onlyHere.push_back(h->GetName()); }
+  for(auto h : histos2D){ if(!other.contains(h->GetName())) onlyHere.push_back(h->GetName()); }
+
+  for(auto h : other.histos){
+    TH1F *hSum = this->find(h->GetName());
+    if(hSum){ hSum->Add(h); continue; }
+    onlyOther.push_back(h->GetName());
+    this->add(h);
+  }
+  for(auto h : other.histos2D){
+    TH2F *hSum = this->find2D(h->GetName());
+    if(hSum){ hSum->Add(h); continue; }
+    onlyOther.push_back(h->GetName());
+    this->add(h);
+  }
+}
+
 float RatePlotter::getProcessSF(TString proc){
   for(unsigned int i(0); i<subtractedProc.size(); i++){ if(subtractedProc[i] == proc) return subtractedProcSF[i]; }
   return 1.;
 }
 
 float RatePlotter::getMCNorm(TFile *f){
+  StageTimer timer(Stats, "getMCNorm");
 
   TH1F *hNorm = (TH1F*)f->Get("MCLumiHist");
   if(!hNorm){ ERROR("getMCNorm", Form("No normalization histogram found in file %s", f->GetName()));}
 
   float mcLumi = hNorm->GetBinContent(1);
   if(mcLumi > 0.){
-    DEBUG("getMCNorm", Form("File %s : MC virtual lumi %.1f", f->GetName(), mcLumi)); 
+    RP_DEBUG("getMCNorm", Form("File %s : MC virtual lumi %.1f", f->GetName(), mcLumi)); 
     return 1./mcLumi;
   } 
   return 1.;
@@ -241,15 +1487,11 @@ float RatePlotter::getMCNorm(TFile *f){
 
 TString RatePlotter::GetXTitle(TH1F* h){
   if(!h) return "";
-  TString name = Form("%s",h->GetName());
-  if( name.Contains("el0") || name.Contains("electron0") ) return "Electron p_{T} [GeV]";
-  if( name.Contains("el1") || name.Contains("electron1") ) return "Electron |#eta|";
-  if( name.Contains("mu0") || name.Contains("muon0")     ) return "Muon p_{T} [GeV]";
-  if( name.Contains("mu1") || name.Contains("muon1")     ) return "Muon |#eta|";
-  
-  if( name.Contains("charge_flip0")|| name.Contains("conversion0") ) return "Electron p_{T} [GeV]";
-  if( name.Contains("charge_flip1")|| name.Contains("conversion1") ) return "Electron |#eta|";
-  return "";  
+  const HistKey &key = this->histKey(h->GetName());
+  if(key.flavor==HistKey::NoFlavor || key.slot()<0 || key.slot()>1) return "";
+
+  const char *flavor = (key.flavor==HistKey::Electron) ? "Electron" : "Muon";
+  return key.axis==0 ? Form("%s p_{T} [GeV]", flavor) : Form("%s |#eta|", flavor);
 }
 
 const char* RatePlotter::getAxisPar(TString name){
@@ -262,8 +1504,8 @@ TGraphAsymmErrors* RatePlotter::getRateGraph(TH1F *hPass, TH1F *hTotal, TString
   TGraphAsymmErrors *g(0);
   if( !checkEntries(hPass,hTotal) ) return g;
 
-  g = new TGraphAsymmErrors(hPass, hTotal, "n");
-  DEBUG("getRateGraph", Form("Created graph (%s): %i points (pass=%s, tot=%s)",source.Data(),(int)g->GetN(),hPass->GetName(),hTotal->GetName()));
+  g = this->track(new TGraphAsymmErrors(hPass, hTotal, "n"), "getRateGraph");
+  RP_DEBUG("getRateGraph", Form("Created graph (%s): %i points (pass=%s, tot=%s)",source.Data(),(int)g->GetN(),hPass->GetName(),hTotal->GetName()));
 
   g->SetLineWidth(2);
   g->SetMarkerStyle(20);
@@ -277,54 +1519,233 @@ TGraphAsymmErrors* RatePlotter::getRateGraph(TH1F *hPass, TH1F *hTotal, TString
   return g;
 }
 
+void RatePlotter::rateKernel(const float *pass, const float *total, float *val, float *err, int n){
+  //Same arithmetic as 0.5*(TEfficiency::Normal(total,pass,0.68,1) - TEfficiency::Normal(total,pass,0.68,0)),
+  //with the normal quantile evaluated once instead of twice per bin
+  const double alpha = (1.0 - 0.68)/2;
+  const double z     = ROOT::Math::normal_quantile(1 - alpha, 1.);
+
+  for(int i(0); i<n; i++){
+    double average = total[i] != 0 ? pass[i] / (double)total[i] : 0.;
+    double sigma   = total[i] != 0 ? std::sqrt(average * (1 - average) / total[i]) : 0.;
+    double delta   = sigma * z;
+    double upper   = total[i] == 0 ? 1.0 : ( (average + delta) > 1 ? 1.0 : (average + delta) );
+    double lower   = total[i] == 0 ? 0.0 : ( (average - delta) < 0 ? 0.0 : (average - delta) );
+
+    val[i] = total[i] > 0. ? pass[i]/total[i] : 0.;
+    err[i] = 0.5*(upper - lower);
+  }
+}
+
 TH1F* RatePlotter::divideTH1(TH1F* hPass, TH1F *hTotal){
   TH1F *h(0);
   if( !checkEntries(hPass,hTotal) ) return h;
 
-  h = (TH1F*)hTotal->Clone(Form("%s_%s",hPass->GetName(),hTotal->GetName()));
+  StageTimer timer(Stats, "divide");
+  h = this->track((TH1F*)hTotal->Clone(Form("%s_%s",hPass->GetName(),hTotal->GetName())), "divideTH1");
+  h->SetDirectory(0);
+  this->dropToyCov(h);
   h->Reset();
-
-  for(int i(1); i<=h->GetNbinsX(); i++){
-    float pass  = hPass->GetBinContent(i);
-    float total = hTotal->GetBinContent(i);
-
-    float val = total > 0. ? pass/total : 0.;
-    float err = 0.5*(TEfficiency::Normal(total,pass,0.68,1) - TEfficiency::Normal(total,pass,0.68,0));
-    if(val<=0.){ 
-      val = hPass->Integral() / hTotal->Integral(); 
-      err = val; 
+  if(!h->GetSumw2N()) h->Sumw2();
+
+  int nBins = h->GetNbinsX();
+  const float *pass  = hPass->GetArray();
+  const float *total = hTotal->GetArray();
+  float  *val = h->GetArray();
+  double *sw2 = h->GetSumw2()->GetArray();
+  std::vector<float> err(nBins+2, 0.);
+
+  this->rateKernel(pass+1, total+1, val+1, &err[1], nBins);
+
+  //Empty bins fall back to the inclusive rate, computed once
+  float fallback(0.);
+  bool  hasFallback(false);
+  for(int i(1); i<=nBins; i++){
+    if(val[i]<=0.){ 
+      if(!hasFallback){ fallback = hPass->Integral() / hTotal->Integral(); hasFallback = true; }
+      val[i] = fallback; 
+      err[i] = val[i]; 
     }
-    DEBUG("divideTH1", Form("Bin (%i): N(pass)=%.3f, N(tot)=%.3f \t Rate=%.2f (err=%.2f)", i, pass, total, val, err));
-    h->SetBinContent(i, val);
-    h->SetBinError(i, err);
+    sw2[i] = (double)err[i]*err[i];
+    RP_DEBUG("divideTH1", Form("Bin (%i): N(pass)=%.3f, N(tot)=%.3f \t Rate=%.2f (err=%.2f)", i, pass[i], total[i], val[i], err[i]));
   }
+  h->SetEntries(nBins);
   return h;
 }
 
+TH1* RatePlotter::toyRates(TH1 *hPass, TH1 *hTotal, const SubtractionPairs &terms, TH2D *&hCov){
+  hCov = 0;
+  if(!hPass || !hTotal || NToys<2) return nullptr;
+  StageTimer timer(Stats, "toys");
+
+  std::vector<int> bins(0);
+  for(int y(1); y<=hTotal->GetNbinsY(); y++){
+    for(int x(1); x<=hTotal->GetNbinsX(); x++) bins.push_back(hTotal->GetBin(x,y));
+  }
+  int n = bins.size();
+
+  //Independent components as content and variance per bin
+  struct Component { std::vector<float> val, var; };
+  std::vector<Component> comps(0);
+  auto addComp = [&](TH1 *h, TH1 *hSub){
+    Component c;
+    for(auto bin : bins){
+      double val = h->GetBinContent(bin), var = h->GetBinError(bin)*h->GetBinError(bin);
+      if(hSub){ val -= hSub->GetBinContent(bin); var -= hSub->GetBinError(bin)*hSub->GetBinError(bin); }
+      c.val.push_back(val > 0. ? val : 0.);
+      c.var.push_back(var > 0. ? var : 0.);
+    }
+    comps.push_back(c);
+    return (int)comps.size()-1;
+  };
+
+  //Pass and fail (total - pass) are independent, the total is their sum. A term with both histograms
+  //is split the same way, pass-only and total-only terms are a single component.
+  struct Term { int pass, fail; float sf; bool toPass, toTot; };
+  std::vector<Term> toyTerms(0);
+  addComp(hPass,  0);
+  addComp(hTotal, hPass);
+  for(auto &term : terms){
+    if(!term.pass && !term.total) continue;
+    Term t;
+    t.sf     = term.sf;
+    t.toPass = term.pass  != 0;
+    t.toTot  = term.total != 0;
+    t.pass   = addComp(term.pass ? term.pass : term.total, 0);
+    t.fail   = (term.pass && term.total) ? addComp(term.total, term.pass) : -1;
+    toyTerms.push_back(t);
+  }
+  int nComps = comps.size();
+  bool clampEach = !ClampOnce;
+
+  //Every toy has its own seeded stream, the result does not depend on the number of threads
+  int nWorkers = std::max(1, std::min(NThreads, NToys));
+  std::vector< std::vector<double> > sums(nWorkers, std::vector<double>(n, 0.));
+  std::vector< std::vector<double> > prods(nWorkers, std::vector<double>(n*n, 0.));
+  auto work = [&](int w){
+    std::vector<double> x(nComps), rate(n);
+    for(int toy(w); toy<NToys; toy+=nWorkers){
+      TRandom3 rnd(ToySeed*1000003u + toy + 1);
+
+      for(int i(0); i<n; i++){
+	//Weighted contents fluctuate with their effective number of entries
+	for(int k(0); k<nComps; k++){
+	  x[k] = comps[k].val[i];
+	  if(x[k]>0. && comps[k].var[i]>0.) x[k] = comps[k].var[i]/x[k] * rnd.Poisson(x[k]*x[k]/comps[k].var[i]);
+	}
+	//Terms are subtracted in order and clamped at zero as in subtract(), pass <= total as in checkEntries, then divided
+	double p = x[0], t = x[0] + x[1];
+	for(auto &term : toyTerms){
+	  double xPass = x[term.pass], xTot = x[term.pass] + (term.fail<0 ? 0. : x[term.fail]);
+	  if(term.toPass){ p -= xPass*term.sf; if(clampEach) p = std::max(p, 0.); }
+	  if(term.toTot){  t -= xTot*term.sf;  if(clampEach) t = std::max(t, 0.); }
+	}
+	p = std::max(p, 0.);
+	t = std::max(t, 0.);
+	p = std::min(p, t);
+	rate[i] = t > 0. ? p/t : 0.;
+      }
+      double *sum = &sums[w][0], *prod = &prods[w][0];
+      for(int i(0); i<n; i++){
+	sum[i] += rate[i];
+	for(int j(0); j<=i; j++) prod[i*n+j] += rate[i]*rate[j];
+      }
+    }
+  };
+  std::vector<std::thread> workers(0);
+  for(int w(1); w<nWorkers; w++) workers.push_back( std::thread(work, w) );
+  work(0);
+  for(auto &t : workers) t.join();
+
+  TH1 *hErr = this->track((TH1*)hTotal->Clone(Form("%s_toyErr",hPass->GetName())), "toyRates");
+  hErr->SetDirectory(0);
+  hErr->Reset();
+  hCov = this->track(new TH2D(Form("%s_toyCov",hPass->GetName()), "Covariance of the in-range bins", n, 0., n, n, 0., n), "toyRates");
+  hCov->SetDirectory(0);
+
+  for(int w(1); w<nWorkers; w++){
+    for(int i(0); i<n; i++)   sums[0][i]  += sums[w][i];
+    for(int i(0); i<n*n; i++) prods[0][i] += prods[w][i];
+  }
+  for(int i(0); i<n; i++){
+    double mi = sums[0][i]/NToys;
+    for(int j(0); j<=i; j++){
+      double mj  = sums[0][j]/NToys;
+      double cov = (prods[0][i*n+j] - NToys*mi*mj)/(NToys-1);
+      hCov->SetBinContent(i+1, j+1, cov);
+      hCov->SetBinContent(j+1, i+1, cov);
+    }
+    hErr->SetBinContent(bins[i], std::sqrt(std::max(0., hCov->GetBinContent(i+1,i+1))));
+  }
+  INFO("toyRates", Form("%i toys of %s/%s with %i subtraction terms on %i threads", NToys, hPass->GetName(), hTotal->GetName(), (int)toyTerms.size(), nWorkers));
+  return hErr;
+}
+
+void RatePlotter::setToyErrors(TH1 *hRate, TH1 *hPass, TH1 *hTotal, TH1 *hToyErr, TH2D *hCov){
+  //The toy errors are released here, the covariance is kept with the rate until writeToFile or dropToyCov
+  if(!hRate || !hToyErr){ delete hToyErr; delete hCov; return; }
+  //Bins without a measured rate keep the uncertainty of the division
+  for(int y(1); y<=hRate->GetNbinsY(); y++){
+    for(int x(1); x<=hRate->GetNbinsX(); x++){
+      int bin = hRate->GetBin(x,y);
+      if(hTotal->GetBinContent(bin) > 0. && hPass->GetBinContent(bin) > 0.) hRate->SetBinError(bin, hToyErr->GetBinContent(bin));
+    }
+  }
+  delete hToyErr;
+  this->dropToyCov(hRate);
+  toyCov[hRate] = hCov;
+}
+
+void RatePlotter::dropToyCov(TH1 *hRate){
+  auto cov = toyCov.find(hRate);
+  if(cov == toyCov.end()) return;
+  delete cov->second;
+  toyCov.erase(cov);
+}
+
 TH2F* RatePlotter::divideTH2(TH2F* hPass, TH2F *hTotal){
   TH2F *h(0);
   if( !checkEntries(hPass,hTotal) ) return h;
 
-  h = (TH2F*)hTotal->Clone(Form("%s_over_%s",hPass->GetName(),hTotal->GetName()));
+  StageTimer timer(Stats, "divide");
+  h = this->track((TH2F*)hTotal->Clone(Form("%s_over_%s",hPass->GetName(),hTotal->GetName())), "divideTH2");
+  h->SetDirectory(0);
+  this->dropToyCov(h);
   h->Reset();
+  if(!h->GetSumw2N()) h->Sumw2();
+
+  int nX = h->GetNbinsX(), nY = h->GetNbinsY(), stride = nX+2;
+  const float *pass  = hPass->GetArray();
+  const float *total = hTotal->GetArray();
+  float  *val = h->GetArray();
+  double *sw2 = h->GetSumw2()->GetArray();
+  std::vector<float> err(stride*(nY+2), 0.);
+
+  //Rows of constant y are contiguous in the bin array
+  for(int y(1); y<=nY; y++){
+    int row = y*stride + 1;
+    this->rateKernel(pass+row, total+row, val+row, &err[row], nX);
+  }
 
-  for(int x(1); x<=h->GetNbinsX(); x++){
-    for(int y(1); y<=h->GetNbinsY(); y++){
-
-      float pass  = hPass->GetBinContent(x,y);
-      float total = hTotal->GetBinContent(x,y); 
-
-      float val = total > 0. ? pass/total : 0.;
-      float err = 0.5*(TEfficiency::Normal(total,pass,0.68,1) - TEfficiency::Normal(total,pass,0.68,0));
-      if(val<=0.){
-	val = hPass->Integral(x-1,x,0,hPass->GetNbinsY()) /  hTotal->Integral(x-1,x,0,hTotal->GetNbinsY());
-	err = val;
+  //Empty bins fall back to the rate of the column slice, computed once per column
+  std::vector<float> fallback(nX+1, 0.);
+  std::vector<bool>  hasFallback(nX+1, false);
+  for(int x(1); x<=nX; x++){
+    for(int y(1); y<=nY; y++){
+      int bin = y*stride + x;
+      if(val[bin]<=0.){
+	if(!hasFallback[x]){
+	  fallback[x] = hPass->Integral(x-1,x,0,hPass->GetNbinsY()) /  hTotal->Integral(x-1,x,0,hTotal->GetNbinsY());
+	  hasFallback[x] = true;
+	}
+	val[bin] = fallback[x];
+	err[bin] = val[bin];
       }
-      DEBUG("divideTH2", Form("Bin (%i|%i): N(pass)=%.3f, N(tot)=%.3f \t Rate=%.2f (err=%.2f)", x, y, pass, total, val, err));
-      h->SetBinContent(x,y,val);
-      h->SetBinError(x,y,err);
+      sw2[bin] = (double)err[bin]*err[bin];
+      RP_DEBUG("divideTH2", Form("Bin (%i|%i): N(pass)=%.3f, N(tot)=%.3f \t Rate=%.2f (err=%.2f)", x, y, pass[bin], total[bin], val[bin], err[bin]));
     }
   }
+  h->SetEntries(nX*nY);
   return h;
 }
 
@@ -357,13 +1778,10 @@ void RatePlotter::setHistStyle(TH2F *h){
   h->GetZaxis()->SetRangeUser(0.00, 0.99);
   //h->GetZaxis()->SetLabelSize(0.04);
   
-  h->GetXaxis()->SetTitle("Lepton p_{T} [GeV]");
-  if( ((TString)h->GetName()).Contains("_mu")) h->GetXaxis()->SetTitle("Muon p_{T} [GeV]");
-  if( ((TString)h->GetName()).Contains("_el")) h->GetXaxis()->SetTitle("Electron p_{T} [GeV]");
-
-  h->GetYaxis()->SetTitle("Lepton |#eta|");
-  if( ((TString)h->GetName()).Contains("_mu")) h->GetYaxis()->SetTitle("Muon |#eta|");
-  if( ((TString)h->GetName()).Contains("_el")) h->GetYaxis()->SetTitle("Electron |#eta|");
+  int flavor = this->histKey(h->GetName()).flavor;
+  const char *lepton = flavor==HistKey::Electron ? "Electron" : (flavor==HistKey::Muon ? "Muon" : "Lepton");
+  h->GetXaxis()->SetTitle(Form("%s p_{T} [GeV]", lepton));
+  h->GetYaxis()->SetTitle(Form("%s |#eta|", lepton));
 
   //h->GetYaxis()->SetTitleSize(0.04);
   h->GetYaxis()->SetTitleOffset(0.9*h->GetYaxis()->GetTitleOffset());
@@ -488,10 +1906,9 @@ void RatePlotter::drawLeptonFlavor(TH1F *h, bool no2pad){
   if(!h) return;
   std::string flavor("");
 
-  TString name = Form("%s",h->GetName());
-  if( name.Contains("_mu") ) flavor = "Muons";
-  if( name.Contains("_el") ) flavor = "Electrons";
-  if( name.Contains("charge_flip")|| name.Contains("conversion") ) flavor = "Electrons"; 
+  int lepton = this->histKey(h->GetName()).flavor;
+  if( lepton==HistKey::Muon )     flavor = "Muons";
+  if( lepton==HistKey::Electron ) flavor = "Electrons";
   if(!flavor.length()) return;
 
   float x1 = 0.18;
@@ -502,7 +1919,7 @@ void RatePlotter::drawLeptonFlavor(TH1F *h, bool no2pad){
 
   if(!AtlasLabel && flavor == "Electrons") x2 += 0.03;
 
-  TLegend *l = new TLegend(x1, y1, x2, y2);
+  TLegend *l = this->track(new TLegend(x1, y1, x2, y2), "drawLeptonFlavor");
   l->SetFillStyle(1111);
   l->SetFillColor(kWhite);
   l->SetBorderSize(1);
@@ -528,10 +1945,9 @@ void RatePlotter::drawLeptonFlavor(TH1F *h, bool no2pad){
 void RatePlotter::draw2DplotLabel(TH2F* h, TString type, TString source){
   
   const char *flavor("");
-  TString name = Form("%s",h->GetName());
-  if( name.Contains("_mu") ) flavor = "Muon";
-  if( name.Contains("_el") ) flavor = "Electron";
-  if( name.Contains("charge_flip")|| name.Contains("conversion") ) flavor = "Electron";
+  int lepton = this->histKey(h->GetName()).flavor;
+  if( lepton==HistKey::Muon )     flavor = "Muon";
+  if( lepton==HistKey::Electron ) flavor = "Electron";
   type.ToLower();
 
   TLatex n;
@@ -557,6 +1973,7 @@ TLegend* RatePlotter::makeLegend(TGraphAsymmErrors *g1, TGraphAsymmErrors *g2, T
   case 2: leg = new TLegend(0.58, 0.74, 0.88, 0.89); break;
   default: return leg;
   }
+  this->track(leg, "makeLegend");
   leg->SetNColumns(1); 
   leg->SetBorderSize(1);
   leg->SetTextFont(42);
@@ -577,7 +1994,7 @@ void RatePlotter::drawRatio(std::vector< TGraphAsymmErrors* > graphs, TH1F* h){
   for(auto g : graphs){
     if(graphs.size()>1 && g==gNom) continue;
 
-    TGraphAsymmErrors *gR = new TGraphAsymmErrors();
+    TGraphAsymmErrors *gR = this->track(new TGraphAsymmErrors(), "drawRatio");
     double x(0),xN(0);
     double y(0),yN(0);
 
@@ -586,7 +2003,7 @@ void RatePlotter::drawRatio(std::vector< TGraphAsymmErrors* > graphs, TH1F* h){
       g->GetPoint(i,x,y);
       float ratio = (y>0 && yN>0) ? y/yN : 0;
 
-      DEBUG("drawRatio", Form("Point %i, x=%.1f, ratio=%.2f", i, x, ratio));
+      RP_DEBUG("drawRatio", Form("Point %i, x=%.1f, ratio=%.2f", i, x, ratio));
       gR->SetPoint(i,x,ratio);
       
       gR->SetPointEXhigh(i, g->GetErrorXhigh(i));
@@ -603,7 +2020,8 @@ void RatePlotter::drawRatio(std::vector< TGraphAsymmErrors* > graphs, TH1F* h){
     VR.push_back(gR);
   }
 
-  TH1F *temp = (TH1F*)h->Clone(Form("Template_%s",h->GetName()));
+  TH1F *temp = this->track((TH1F*)h->Clone(Form("Template_%s",h->GetName())), "drawRatio");
+  temp->SetDirectory(0);
   setRatioHistStyle(temp);
   temp->Draw("AXIS");
 
@@ -612,7 +2030,7 @@ void RatePlotter::drawRatio(std::vector< TGraphAsymmErrors* > graphs, TH1F* h){
   else
     this->drawEtaRegions(temp, yRMin, true);
 
-  TLine *l = new TLine();
+  TLine *l = this->track(new TLine(), "drawRatio");
   l->SetLineColor(kGray+1);
   l->SetLineStyle(9);
   l->SetLineWidth(1);
@@ -628,18 +2046,19 @@ void RatePlotter::makeRatePlot(TString namePass, TString nameTot){
 
   INFO("makeRatePlot", Form("[MC|Data] = [%i|%i]",(int)MCRates,(int)DataRates));
   
-  if(MCRates)   histosMC   = getHistosFromList(MCFiles, effDir);
-  if(DataRates) histosData = getHistosFromList(DataFiles, effDir);
+  //Inputs of the previous call are released first
+  if(MCRates)   { histosMC.deleteAll();   histosMC   = getHistosFromList(MCFiles, effDir); }
+  if(DataRates) { histosData.deleteAll(); histosData = getHistosFromList(DataFiles, effDir); }
   this->lumiScale(histosMC);
 
+  //Prompt and MC process contributions are subtracted in one fused pass, as in makeRatePlot2D
+  HistRegistry histosPrompt;
   if(Prompt && DataRates){
     INFO("makeRatePlot", Form("Subtracting prompt processes from %i files", (int)PromptMCFiles.size()));
-    std::vector<TH1F*> histosPrompt = getHistosFromList(PromptMCFiles, effDir);
-   
+    histosPrompt = getHistosFromList(PromptMCFiles, effDir);
     this->lumiScale(histosPrompt);
-    this->subtractPrompt(histosData, histosPrompt);
   }
-  if(!namePass.Length() || !nameTot.Length()){ INFO("makeRatePlot", "No input names provided"); return;}
+  if(!namePass.Length() || !nameTot.Length()){ INFO("makeRatePlot", "No input names provided"); histosPrompt.deleteAll(); return;}
 
   INFO("makeRatePlot", Form("Calculating rates from %s over %s",namePass.Data(),nameTot.Data()));
   
@@ -649,25 +2068,42 @@ void RatePlotter::makeRatePlot(TString namePass, TString nameTot){
   if(MCRates){
     h1_MC = findHisto(nameTot, histosMC);
     h2_MC = findHisto(namePass,histosMC);
-    this->subtractMCProcess(h1_MC, h2_MC, histosMC);
+    SubtractionPairs terms(0);
+    this->getMCProcessTerms(h1_MC, h2_MC, histosMC, terms);
+
+    TH2D *hCov(0);
+    TH1 *hToyErr = this->toyRates(h2_MC, h1_MC, terms, hCov);
+    this->subtract(h1_MC, h2_MC, terms);
 
     hMC = divideTH1(h2_MC, h1_MC);
+    this->setToyErrors(hMC, h2_MC, h1_MC, hToyErr, hCov);
     gMC = getRateGraph(h2_MC, h1_MC, "MC_blue");
   }
 
   if(DataRates){
     h1_Data = findHisto(nameTot, histosData);
     h2_Data = findHisto(namePass,histosData);
-    this->subtractMCProcess(h1_Data, h2_Data, histosMC);
+    SubtractionPairs terms(0);
+    if(Prompt){
+      TH1F *hPromptPass = findHisto(namePass, histosPrompt);
+      TH1F *hPromptTot  = findHisto(nameTot,  histosPrompt);
+      terms.push_back({hPromptPass, hPromptTot, 1.f});
+    }
+    this->getMCProcessTerms(h1_Data, h2_Data, histosMC, terms);
+
+    TH2D *hCov(0);
+    TH1 *hToyErr = this->toyRates(h2_Data, h1_Data, terms, hCov);
+    this->subtract(h1_Data, h2_Data, terms);
 
     hData = divideTH1(h2_Data, h1_Data);
+    this->setToyErrors(hData, h2_Data, h1_Data, hToyErr, hCov);
     gData = getRateGraph(h2_Data, h1_Data, "Data");
   }
   
   if(!Style) this->setStyle(1);  
   TString cname = Form("%s_over_%s",namePass.Data(),nameTot.Data());
   cname = addSuffix(cname.Data());
-  TCanvas *c  = new TCanvas(cname, cname, 1, 10, 770, 560);
+  TCanvas *c  = this->track(new TCanvas(cname, cname, 1, 10, 770, 560), "makeRatePlot");
 
   TPad *p1 = new TPad(cname+"_p1",cname+"_p1", 0.00, 0.30, 1.00, 1.00, -1, 0, 0);
   TPad *p2 = new TPad(cname+"_p2",cname+"_p1", 0.00, 0.00, 1.00, 0.30, -1, 0, 0);
@@ -681,7 +2117,8 @@ void RatePlotter::makeRatePlot(TString namePass, TString nameTot){
   p1->Draw();
 
   p1->cd();
-  TH1F* hTemp = h1_Data ? h1_Data : h1_MC;
+  TH1F* hTemp = this->track((TH1F*)(h1_Data ? h1_Data : h1_MC)->Clone(), "makeRatePlot");
+  hTemp->SetDirectory(0);
   hTemp->Reset();
   setHistStyle(hTemp);
   if( ((TString)hTemp->GetXaxis()->GetTitle()).Contains("p_{T}") ){
@@ -711,14 +2148,15 @@ void RatePlotter::makeRatePlot(TString namePass, TString nameTot){
 
   if(hData && writeHist)
     this->writeToFile(hData, RateType, "Data", outFile);
+  histosPrompt.deleteAll();
 
+  //The rate histograms are not drawn, the output holds copies
+  this->dropToyCov(hMC);
+  this->dropToyCov(hData);
+  delete hMC;
+  delete hData;
 
-  if(Print){
-    if(!(bool)outDir.length()) outDir = ".";
-    this->checkDir(outDir);
-    c->Print(Form("%s/%s.%s",outDir.c_str(),c->GetName(),figType));
-    INFO("makeRatePlot", Form("Created %s/%s.%s",outDir.c_str(),c->GetName(),figType));
-  }
+  if(Print) this->exportCanvas(c, "makeRatePlot");
 }
 
 void RatePlotter::makeRatePlot2D(TString namePass, TString nameTot, TString source){
@@ -733,57 +2171,54 @@ void RatePlotter::makeRatePlot2D(TString namePass, TString nameTot, TString sour
   if(source=="Data") files = DataFiles;
   if(files.empty()){ INFO("makeRatePlot2D", "No source [Data|MC] selected"); return; }
 
-  TFile *f0 = new TFile(files.front().c_str());
-  TH2F *hPass = (TH2F*)f0->Get( Form("%s/%s",effDir,namePass.Data()) );
-  TH2F *hTot  = (TH2F*)f0->Get( Form("%s/%s",effDir,nameTot.Data())  );
+  HistRegistry histos = getHistosFromList(files, effDir);
+  if(source=="MC") this->lumiScale(histos);
 
-  if(!hPass || !hTot){ INFO("makeRatePlot2D", "No matching histogram found"); return; }
-  hPass->Reset();
-  hTot->Reset();
+  TH2F *hPass = findHisto2D(namePass, histos);
+  TH2F *hTot  = findHisto2D(nameTot,  histos);
+  if(!hPass || !hTot){ INFO("makeRatePlot2D", "No matching histogram found"); histos.deleteAll(); return; }
+  INFO("makeRatePlot2D", Form("Calculating rates (%s) from %s over %s in %s from %i files",source.Data(),namePass.Data(),nameTot.Data(),effDir,(int)files.size()));
 
+  //Prompt and MC process contributions are subtracted in one fused pass
   TH2F *hRate(0);
-  for(auto file : files){
-    TFile *f = new TFile(file.c_str());
-    float scale = (source=="MC") ? getMCNorm(f) : 1.;
-    
-    TH2F *hp = (TH2F*)f->Get( Form("%s/%s",effDir,namePass.Data()) );
-    TH2F *ht = (TH2F*)f->Get( Form("%s/%s",effDir,nameTot.Data()) );
-    hp->Scale(scale); 
-    ht->Scale(scale);
-    
-    hPass->Add(hp);
-    hTot->Add(ht);
-
-    INFO("makeRatePlot2D", Form("File %s/%s : Calculating rates (%s) from %s over %s",f->GetName(),effDir,source.Data(),namePass.Data(),nameTot.Data()));
-  }
-  if(source=="MC"){ hPass->Scale(Lumi); hTot->Scale(Lumi); }
-
+  SubtractionPairs terms(0);
+  HistRegistry histosPrompt, histosProc;
   if(Prompt && source=="Data"){
     INFO("makeRatePlot2D", Form("Subtracting prompt processes from %i files", (int)PromptMCFiles.size()));
+    histosPrompt = getHistosFromList(PromptMCFiles, effDir);
+    this->lumiScale(histosPrompt);
 
-    for(auto promptFile : PromptMCFiles){
-      TFile *f = new TFile(promptFile.c_str());
-      float scale = getMCNorm(f);
-      INFO("makeRatePlot2D", Form("Subtract prompt rates from file %s (MC norm: 1/%.1f)",f->GetName(),1./scale));
-
-      TH2F *hp_prompt = (TH2F*)f->Get( Form("%s/%s",effDir,namePass.Data()) );
-      TH2F *ht_prompt = (TH2F*)f->Get( Form("%s/%s",effDir,nameTot.Data()) );
-      hp_prompt->Scale(Lumi*scale);
-      ht_prompt->Scale(Lumi*scale);
-
-      this->subtract(hPass, hp_prompt);
-      this->subtract(hTot,  ht_prompt);
+    TH2F *hPromptPass = findHisto2D(namePass, histosPrompt);
+    TH2F *hPromptTot  = findHisto2D(nameTot,  histosPrompt);
+    terms.push_back({hPromptPass, hPromptTot, 1.f});
+  }
+  if(!subtractedProc.empty() && !MCFiles.empty()){
+    histosProc = histos;
+    if(source!="MC"){
+      histosProc = getHistosFromList(MCFiles, effDir);
+      this->lumiScale(histosProc);
     }
+    this->getMCProcessTerms2D(hTot, hPass, histosProc, terms);
   }
-  this->subtractMCProcess2D(hTot, hPass, MCFiles);
+  //Toys need the inputs before the subtraction
+  TH2D *hCov(0);
+  TH1 *hToyErr = this->toyRates(hPass, hTot, terms, hCov);
+
+  this->subtract(hTot, hPass, terms);
   hRate = divideTH2(hPass, hTot);
+  this->setToyErrors(hRate, hPass, hTot, hToyErr, hCov);
+
+  //The rate is a detached clone and the inputs are released, histosProc is histos for MC
+  if(source!="MC") histosProc.deleteAll();
+  histosPrompt.deleteAll();
+  histos.deleteAll();
 
   if(!Style) this->setStyle(1);
   setHistStyle(hRate);
 
   TString cname = Form("%s_over_%s_%s_%s",namePass.Data(),nameTot.Data(),RateType.Data(),source.Data());
   cname = addSuffix(cname.Data());
-  TCanvas *c  = new TCanvas(cname, cname, 1, 10, 770, 560);
+  TCanvas *c  = this->track(new TCanvas(cname, cname, 1, 10, 770, 560), "makeRatePlot2D");
   c->cd();
 
   TPad *p = new TPad(cname+"_p",cname+"_p", 0.00, 0.00, 1.00, 0.95, -1, 0, 0);
@@ -803,26 +2238,24 @@ void RatePlotter::makeRatePlot2D(TString namePass, TString nameTot, TString sour
 
   if(writeHist) 
     this->writeToFile(hRate, RateType, source, outFile);
+  this->dropToyCov(hRate);
 
-  if(Print){
-    if(!(bool)outDir.length()) outDir = ".";
-    this->checkDir(outDir);
-    c->Print(Form("%s/%s.%s",outDir.c_str(),c->GetName(),figType));
-    INFO("makeRatePlot2D", Form("Created %s/%s.%s",outDir.c_str(),c->GetName(),figType));
-  }
+  if(Print) this->exportCanvas(c, "makeRatePlot2D");
 }
 
 TString RatePlotter::getOriginLabel(TString name){
-  if(name.Contains("Fakes"))              return "All fakes";
-  else if(name.Contains("HF"))            return "Heavy flavor";
-  else if(name.Contains("LF"))            return "Light flavor";
-  else if(name.Contains("conversion"))    return "Conversion";
-  else if(name.Contains("prompt"))        return "Prompt";
-  else if(name.Contains("charge_flip"))   return "Charge flip";
-  else if(name.Contains("Muon_electron")) return "Muon elec.";
-  else if(name.Contains("Tau_electron"))  return "Tau elec.";
-  else if(name.Contains("Tau_muon"))      return "Tau muon";
-  else if(name.Contains("not_classified"))return "Unclassified";
+  const HistKey &key = this->histKey(name);
+  const TString &source = key.source;
+  if(source=="Fakes")                 return "All fakes";
+  else if(source=="HF")               return "Heavy flavor";
+  else if(source=="LF")               return "Light flavor";
+  else if(source=="conversion")       return "Conversion";
+  else if(source=="prompt")           return "Prompt";
+  else if(source=="charge_flip")      return "Charge flip";
+  else if(source=="Muon" && key.flavor==HistKey::Electron) return "Muon elec.";
+  else if(source=="Tau"  && key.flavor==HistKey::Electron) return "Tau elec.";
+  else if(source=="Tau"  && key.flavor==HistKey::Muon)     return "Tau muon";
+  else if(source=="not_classified")   return "Unclassified";
   else return "";
 }
 
@@ -831,6 +2264,7 @@ void RatePlotter::compareMCRates(TString namePass1, TString nameTot1, TString na
   std::cout << std::endl;
   if(!MCRates){ INFO("compareMCRates", "No MC input provided"); return;}
 
+  histosMC.deleteAll();
   histosMC = getHistosFromList(MCFiles, effDir);
   this->lumiScale(histosMC);  
 
@@ -854,7 +2288,7 @@ void RatePlotter::compareMCRates(TString namePass1, TString nameTot1, TString na
   if(!Style) this->setStyle(1);  
   TString cname = Form("%s_over_%s_AND_%s_over_%s",namePass1.Data(),nameTot1.Data(),namePass2.Data(),nameTot2.Data());
   cname = addSuffix(cname.Data());  
-  TCanvas *c  = new TCanvas(cname, cname, 1, 10, 770, 560);
+  TCanvas *c  = this->track(new TCanvas(cname, cname, 1, 10, 770, 560), "compareMCRates");
 
   TPad *p1 = new TPad(cname+"_p1",cname+"_p1", 0.00, 0.30, 1.00, 1.00, -1, 0, 0);
   TPad *p2 = new TPad(cname+"_p2",cname+"_p1", 0.00, 0.00, 1.00, 0.30, -1, 0, 0);
@@ -868,7 +2302,8 @@ void RatePlotter::compareMCRates(TString namePass1, TString nameTot1, TString na
   p1->Draw();
 
   p1->cd();
-  TH1F* hTemp = h1_MC1;
+  TH1F* hTemp = this->track((TH1F*)h1_MC1->Clone(), "compareMCRates");
+  hTemp->SetDirectory(0);
   hTemp->Reset();
   setHistStyle(hTemp);
   if( ((TString)hTemp->GetXaxis()->GetTitle()).Contains("p_{T}") ){
@@ -893,12 +2328,7 @@ void RatePlotter::compareMCRates(TString namePass1, TString nameTot1, TString na
   p2->cd();
   this->drawRatio(vec(gMC1,gMC2), hTemp);
 
-  if(Print){
-    if(!(bool)outDir.length()) outDir = ".";
-    this->checkDir(outDir);
-    c->Print(Form("%s/%s.%s",outDir.c_str(),c->GetName(),figType));
-    INFO("makeRatePlot2D", Form("Created %s/%s.%s",outDir.c_str(),c->GetName(),figType));
-  }
+  if(Print) this->exportCanvas(c, "makeRatePlot2D");
 }
 
 void RatePlotter::compareSelections(TString namePass, TString nameTot, std::vector< std::pair<std::string, std::string> > selections, TString source){
@@ -916,15 +2346,16 @@ void RatePlotter::compareSelections(TString namePass, TString nameTot, std::vect
     const char *dir = selection.first.c_str();
     INFO("compareSelec", Form("Selection dir: %s (%s)", dir, selection.second.c_str()));
 
-    std::vector<TH1F*> histos(0);
+    HistRegistry histos;
     if(source=="Data"){ 
       histos = getHistosFromList(DataFiles, dir);
       if(Prompt){
 	INFO("compareSelec", Form("Subtracting prompt processes from %i files", (int)PromptMCFiles.size()));
-	std::vector<TH1F*> histosPrompt = getHistosFromList(PromptMCFiles, dir);
+	HistRegistry histosPrompt = getHistosFromList(PromptMCFiles, dir);
 
 	this->lumiScale(histosPrompt);
 	this->subtractPrompt(histos, histosPrompt);
+	histosPrompt.deleteAll();
       }
     }
     if(source=="MC"){   
@@ -938,20 +2369,27 @@ void RatePlotter::compareSelections(TString namePass, TString nameTot, std::vect
     h2 = findHisto(namePass, histos);
     
     if(!subtractedProc.empty()){
-      std::vector<TH1F*> subtractionHistos = getHistosFromList(MCFiles, dir);
+      HistRegistry subtractionHistos = getHistosFromList(MCFiles, dir);
       this->lumiScale(subtractionHistos);
       this->subtractMCProcess(h1, h2, subtractionHistos);
+      subtractionHistos.deleteAll();
     }        
     TGraphAsymmErrors *g = getRateGraph(h2, h1);
-    hTemp = h1;
     RateGraphs.push_back(g);
+
+    //The axis frame outlives the inputs of this selection
+    if(!hTemp){
+      hTemp = this->track((TH1F*)h1->Clone(), "compareSelections");
+      hTemp->SetDirectory(0);
+    }
+    histos.deleteAll();
   }
   INFO("compareSelec", Form("Created rate plots (%s) for %i selections", source.Data(), (int)RateGraphs.size()));
 
   if(!Style) this->setStyle(1);  
   TString cname = Form("%s_over_%s_Selections_%s",namePass.Data(),nameTot.Data(),source.Data());
   cname = addSuffix(cname.Data());  
-  TCanvas *c  = new TCanvas(cname, cname, 1, 10, 770, 560);
+  TCanvas *c  = this->track(new TCanvas(cname, cname, 1, 10, 770, 560), "compareSelections");
 
   TPad *p1 = new TPad(cname+"_p1",cname+"_p1", 0.00, 0.30, 1.00, 1.00, -1, 0, 0);
   TPad *p2 = new TPad(cname+"_p2",cname+"_p1", 0.00, 0.00, 1.00, 0.30, -1, 0, 0);
@@ -1003,6 +2441,7 @@ void RatePlotter::compareSelections(TString namePass, TString nameTot, std::vect
   case 6: leg = new TLegend(0.58, 0.58, 0.91, 0.91); break;
   default: break;
   }
+  this->track(leg, "compareSelections");
   leg->SetNColumns(1); 
   leg->SetBorderSize(1);
   leg->SetTextFont(42);
@@ -1018,63 +2457,54 @@ void RatePlotter::compareSelections(TString namePass, TString nameTot, std::vect
   p2->cd();
   this->drawRatio(RateGraphs, hTemp);
 
-  if(Print){
-    if(!(bool)outDir.length()) outDir = ".";
-    this->checkDir(outDir);
-    c->Print(Form("%s/%s.%s",outDir.c_str(),c->GetName(),figType));
-    INFO("compareSelec", Form("Created %s/%s.%s",outDir.c_str(),c->GetName(),figType));
-  }
+  if(Print) this->exportCanvas(c, "compareSelec");
 }
 
-void RatePlotter::subtractPrompt(std::vector<TH1F*> data, std::vector<TH1F*> prompt){
-  if(data.empty() || prompt.empty() || (data.size() != prompt.size())){ 
-    INFO("subtractPrompt", "Lists are empty or N(data) != N(prompt)");
+void RatePlotter::subtractPrompt(HistRegistry &data, HistRegistry &prompt){
+  if(data.empty() || prompt.empty()){ 
+    INFO("subtractPrompt", "Lists are empty");
     return;
   }
-  for(unsigned int i(0); i<data.size(); i++) this->subtract(data[i], prompt[i]);
+  for(auto h : data.list()){
+    TH1F *hPrompt = prompt.contains(h->GetName()) ? prompt.find(h->GetName()) : dynamic_cast<TH1F*>(this->loadHisto(h->GetName(), prompt));
+    if(!hPrompt){ INFO("subtractPrompt", Form("No prompt histogram %s found, not subtracted", h->GetName())); continue; }
+    this->subtract(h, hPrompt);
+  }
+  for(auto h : data.list2D()){
+    TH2F *hPrompt = prompt.contains(h->GetName()) ? prompt.find2D(h->GetName()) : dynamic_cast<TH2F*>(this->loadHisto(h->GetName(), prompt));
+    if(!hPrompt){ INFO("subtractPrompt", Form("No prompt histogram %s found, not subtracted", h->GetName())); continue; }
+    this->subtract(h, hPrompt);
+  }
+  if(LazyLoad) data.addLazySubtraction(prompt);
 }
 
-void RatePlotter::subtractMCProcess(TH1F* histInputTot, TH1F *histInputPass, std::vector<TH1F*> histProc){
+void RatePlotter::subtractMCProcess(TH1F* histInputTot, TH1F *histInputPass, HistRegistry &histProc){
   
-  if(subtractedProc.empty() || !histProc.size() || !histInputPass || !histInputTot){ 
+  if(subtractedProc.empty() || histProc.empty() || !histInputPass || !histInputTot){ 
     INFO("subtractMCProc", "No MC processes subtracted"); return; 
   }
-  TString name = histInputTot->GetName();
+  SubtractionPairs terms(0);
+  this->getMCProcessTerms(histInputTot, histInputPass, histProc, terms);
+  this->subtract(histInputTot, histInputPass, terms);
+  return;
+}
+
+void RatePlotter::getMCProcessTerms(TH1F* histInputTot, TH1F *histInputPass, HistRegistry &histProc, SubtractionPairs &terms){
+
+  if(subtractedProc.empty() || histProc.empty() || !histInputPass || !histInputTot) return;
+  const HistKey &key = this->histKey(histInputTot->GetName());
+  bool inclusive = key.inclusive() && key.flavor!=HistKey::NoFlavor && (key.slot()==0 || key.slot()==1);
 
   for(auto proc : subtractedProc){ 
     TH1F* hProcTot(0), *hProcPass(0);
     TString nameProcPass(""), nameProcTot("");
     float sf = getProcessSF(proc);
 
-    if(name.Contains("el0")){
-      nameProcPass = Form("histoTight_%s_electron0",proc.Data());
-      nameProcTot  = Form("histoLoose_%s_electron0",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")){
-	nameProcPass = Form("histoTight_%s0",proc.Data()); 
-	nameProcTot  = Form("histoLoose_%s0",proc.Data());
-      }
-    }
-    if(name.Contains("el1")){
-      nameProcPass = Form("histoTight_%s_electron1",proc.Data());
-      nameProcTot  = Form("histoLoose_%s_electron1",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")){
-	nameProcPass = Form("histoTight_%s1",proc.Data());
-	nameProcTot  = Form("histoLoose_%s1",proc.Data());
-      }
-    }
-    if(name.Contains("mu0")){
-      nameProcPass = Form("histoTight_%s_muon0",proc.Data());
-      nameProcTot  = Form("histoLoose_%s_muon0",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")) continue;
-    }
-    if(name.Contains("mu1")){
-      nameProcPass = Form("histoTight_%s_muon1",proc.Data());
-      nameProcTot  = Form("histoLoose_%s_muon1",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")) continue;
+    if(inclusive){
+      if(HistKey::electronOnly(proc) && key.flavor==HistKey::Muon) continue;
+      TString lepton = HistKey::electronOnly(proc) ? "" : (key.flavor==HistKey::Electron ? "_electron" : "_muon");
+      nameProcPass = Form("histoTight_%s%s%i",proc.Data(),lepton.Data(),key.axis);
+      nameProcTot  = Form("histoLoose_%s%s%i",proc.Data(),lepton.Data(),key.axis);
     }
     hProcTot  = findHisto(nameProcTot, histProc);
     hProcPass = findHisto(nameProcPass,histProc);
@@ -1084,58 +2514,47 @@ void RatePlotter::subtractMCProcess(TH1F* histInputTot, TH1F *histInputPass, std
     }
     INFO("subtractMCProc", Form("Subtracting histograms [%s|%s] (SF=%.1f) from [%s|%s]", hProcPass->GetName(), hProcTot->GetName(), sf, histInputPass->GetName(), histInputTot->GetName()));
 
-    this->subtract(histInputTot,  hProcTot,  sf);
-    this->subtract(histInputPass, hProcPass, sf);
+    terms.push_back({hProcPass, hProcTot, sf});
   }
   return;
 }
 
-void RatePlotter::subtractMCProcess2D(TH2F* histInputTot, TH2F *histInputPass, std::vector<std::string> files){
+void RatePlotter::subtractMCProcess2D(TH2F* histInputTot, TH2F *histInputPass, HistRegistry &histProc){
 
-  if(subtractedProc.empty() || !files.size() || !histInputPass || !histInputTot){
+  if(subtractedProc.empty() || histProc.empty() || !histInputPass || !histInputTot){
     INFO("subtractMCProc", "No MC processes subtracted"); return;
   }
-  TString name = histInputTot->GetName();
+  SubtractionPairs terms(0);
+  this->getMCProcessTerms2D(histInputTot, histInputPass, histProc, terms);
+  this->subtract(histInputTot, histInputPass, terms);
+  return;
+}
+
+void RatePlotter::getMCProcessTerms2D(TH2F* histInputTot, TH2F *histInputPass, HistRegistry &histProc, SubtractionPairs &terms){
+
+  if(subtractedProc.empty() || histProc.empty() || !histInputPass || !histInputTot) return;
+  const HistKey &key = this->histKey(histInputTot->GetName());
+  bool inclusive = key.inclusive() && key.dim==2 && key.flavor!=HistKey::NoFlavor;
 
   for(auto proc : subtractedProc){
-    TH2F* histTempTot  = (TH2F*)histInputTot->Clone(Form("Template_%s_%s",proc.Data(),histInputTot->GetName()));
-    TH2F* histTempPass = (TH2F*)histInputPass->Clone(Form("Template_%s_%s",proc.Data(),histInputPass->GetName()));
-    histTempTot->Reset();
-    histTempPass->Reset();
     float sf = getProcessSF(proc);
   
     TString nameProcPass(""), nameProcTot("");
-    if(name.Contains("_el")){
-      nameProcPass = Form("histo2D_Tight_%s_electron",proc.Data());
-      nameProcTot  = Form("histo2D_Loose_%s_electron",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")){
-	nameProcPass = Form("histo2D_Tight_%s",proc.Data());
-	nameProcTot  = Form("histo2D_Loose_%s",proc.Data());
-      }
-    }
-    if(name.Contains("_mu")){
-      nameProcPass = Form("histo2D_Tight_%s_muon",proc.Data());
-      nameProcTot  = Form("histo2D_Loose_%s_muon",proc.Data());
-
-      if(proc.Contains("charge_flip") || proc.Contains("conversion")) continue;
+    if(inclusive){
+      if(HistKey::electronOnly(proc) && key.flavor==HistKey::Muon) continue;
+      TString lepton = HistKey::electronOnly(proc) ? "" : (key.flavor==HistKey::Electron ? "_electron" : "_muon");
+      nameProcPass = Form("histo2D_Tight_%s%s",proc.Data(),lepton.Data());
+      nameProcTot  = Form("histo2D_Loose_%s%s",proc.Data(),lepton.Data());
     }
-    for(auto file : files){
-      TFile *f = new TFile(file.c_str());
-      float scale = getMCNorm(f);
-
-      TH2F *ht = (TH2F*)f->Get( Form("%s/%s",effDir,nameProcTot.Data()) );
-      TH2F *hp = (TH2F*)f->Get( Form("%s/%s",effDir,nameProcPass.Data()) );
-      ht->Scale(Lumi*scale);
-      hp->Scale(Lumi*scale);
+    TH2F *hProcTot  = findHisto2D(nameProcTot, histProc);
+    TH2F *hProcPass = findHisto2D(nameProcPass,histProc);
 
-      histTempTot->Add(ht);
-      histTempPass->Add(hp);
+    if(!hProcTot || !hProcPass){ 
+      INFO("subtractMCProc", Form("No histograms [%s|%s] found", nameProcTot.Data(), nameProcPass.Data())); continue; 
     }
-    INFO("subtractMCProc", Form("Subtracting histograms [%s|%s] (SF=%.1f) from [%s|%s]", histTempPass->GetName(), histTempTot->GetName(), sf, histInputPass->GetName(), histInputTot->GetName()));
+    INFO("subtractMCProc", Form("Subtracting histograms [%s|%s] (SF=%.1f) from [%s|%s]", hProcPass->GetName(), hProcTot->GetName(), sf, histInputPass->GetName(), histInputTot->GetName()));
 
-    this->subtract(histInputTot,  histTempTot,  sf);
-    this->subtract(histInputPass, histTempPass, sf);
+    terms.push_back({hProcPass, hProcTot, sf});
   }
   return;
 }
@@ -1181,16 +2600,15 @@ bool RatePlotter::checkEntries(TH2F* pass, TH2F* total){
 
 void RatePlotter::writeToFile(TH1* hTemp, TString type, TString source, const char* outname){
   if(!hTemp){ INFO("writeToFile", "Nothing to write"); return; }
+  StageTimer timer(Stats, "writeToFile");
   this->checkDir(outDir);
   
   TString filename = Form("%s/%s%s_%s.root", outDir.c_str(), outname, Form("%iD",(int)hTemp->GetDimension()), source.Data());
-  TFile *f = TFile::Open(filename, "UPDATE");
-  f->cd();
 
-  TString hName = hTemp->GetName();
   const char *flavor("");
-  if( hName.Contains("_mu") ) flavor = "mu";
-  if( hName.Contains("_el") ) flavor = "el";
+  int lepton = this->histKey(hTemp->GetName()).flavor;
+  if( lepton==HistKey::Muon )     flavor = "mu";
+  if( lepton==HistKey::Electron ) flavor = "el";
 
   TH1F *hOut1D(0);
   TH2F *hOut2D(0);
@@ -1215,103 +2633,77 @@ void RatePlotter::writeToFile(TH1* hTemp, TString type, TString source, const ch
     break;
   default: break;
   }
-  if(hOut1D){
-    subtractNominal(f,hOut1D);
-    hOut1D->Write();
-    INFO("writeToFile", Form("Wrote histogram %s/%s",f->GetName(),hOut1D->GetName()));
+  TH1 *hOut = hOut1D ? (TH1*)hOut1D : (TH1*)hOut2D;
+  if(!hOut) return;
+  hOut->SetDirectory(0);
+
+  {
+    std::lock_guard<std::mutex> guard(Writer.fileMutex());
+    TFile *f = Writer.open(filename.Data());
+    if(!f){ INFO("writeToFile", Form("Cannot open %s", filename.Data())); delete hOut; return; }
+    subtractNominal(f,hOut);
+
+    //Nominal rates are indexed when queued, later variations do not wait for the write
+    if(subNomRate && !TString(hOut->GetName()).Contains("__")){
+      std::map<std::string, TH1*> &index = this->nominalIndex(f);
+      if(index.count(hOut->GetName())) delete index[hOut->GetName()];
+      TH1 *hNom = (TH1*)hOut->Clone();
+      hNom->SetDirectory(0);
+      index[hOut->GetName()] = hNom;
+    }
   }
-  if(hOut2D){
-    subtractNominal(f,hOut2D);
-    hOut2D->Write();
-    INFO("writeToFile", Form("Wrote histogram %s/%s",f->GetName(),hOut2D->GetName()));
+  Writer.queue(filename.Data(), hOut);
+  INFO("writeToFile", Form("Queued histogram %s/%s",filename.Data(),hOut->GetName()));
+
+  //Toy covariance of the rate map, written next to it as <name>_cov[__suffix]
+  auto cov = toyCov.find(hTemp);
+  if(cov != toyCov.end()){
+    TString name = hOut->GetName();
+    int pos = name.Index("__");
+    TString covName = (pos<0) ? name+"_cov" : TString(name(0,pos))+"_cov"+TString(name(pos,name.Length()-pos));
+    TH2D *hCov = (TH2D*)cov->second->Clone(covName);
+    hCov->SetDirectory(0);
+    Writer.queue(filename.Data(), hCov);
+    this->dropToyCov(hTemp);
   }
-  f->Close();
   return;
 }
 
-void RatePlotter::addFakeHist(std::vector<TH1F*> &histos, TString opt){
+void RatePlotter::addFakeHist(HistRegistry &histos, TString opt){
   if(histos.empty() || !opt.Length()){ INFO("addFakeHist", "Empty input or no lepton type selected.. returning"); return; }
-
-  TH1F* h0_loose(0), *h1_loose(0), *hA_loose(0);
-  TH1F* h0_tight(0), *h1_tight(0), *hA_tight(0);
-
-  if( opt=="Mu" ){
-    for(auto suf : FakeSourcesMu) DEBUG("addFakeHist", Form("Merging muon histograms with suffix : %s", suf.Data()));
-
-    h0_loose = (TH1F*) (this->findHisto("histoLoose_mu0",    histos))->Clone("histoLoose_Fakes_muon0");
-    h1_loose = (TH1F*) (this->findHisto("histoLoose_mu1",    histos))->Clone("histoLoose_Fakes_muon1");
-    hA_loose = (TH1F*) (this->findHisto("all_histoLoose_mu", histos))->Clone("all_histoLoose_Fakes_muon");
-    
-    h0_tight = (TH1F*) (this->findHisto("histoTight_mu0",    histos))->Clone("histoTight_Fakes_muon0");
-    h1_tight = (TH1F*) (this->findHisto("histoTight_mu1",    histos))->Clone("histoTight_Fakes_muon1");
-    hA_tight = (TH1F*) (this->findHisto("all_histoTight_mu", histos))->Clone("all_histoTight_Fakes_muon");
-    
-    h0_loose->Reset(); h0_tight->Reset();
-    h1_loose->Reset(); h1_tight->Reset();
-    hA_loose->Reset(); hA_tight->Reset();
-
-    for(auto h : histos){
-      TString hname = h->GetName();
-
-      for(auto suf : FakeSourcesMu){
-
-	if(hname.Contains(suf) && hname.Contains("histoLoose")     && hname.Contains("muon0")) h0_loose->Add(h); 
-	if(hname.Contains(suf) && hname.Contains("histoLoose")     && hname.Contains("muon1")) h1_loose->Add(h);
-	if(hname.Contains(suf) && hname.Contains("all_histoLoose") && hname.Contains("muon") ) hA_loose->Add(h);
-
-	if(hname.Contains(suf) && hname.Contains("histoTight")     && hname.Contains("muon0")) h0_tight->Add(h);
-	if(hname.Contains(suf) && hname.Contains("histoTight")     && hname.Contains("muon1")) h1_tight->Add(h);
-	if(hname.Contains(suf) && hname.Contains("all_histoTight") && hname.Contains("muon") ) hA_tight->Add(h);  
-      }
-    }
+  if(opt!="Mu" && opt!="El") return;
+  StageTimer timer(Stats, "addFakeHist");
+
+  bool muon = opt=="Mu";
+  const char *flavor = muon ? "mu" : "el";
+  const char *lepton = muon ? "muon" : "electron";
+  const std::vector<TString> &sources = muon ? FakeSourcesMu : FakeSourcesEl;
+  for(auto suf : sources) RP_DEBUG("addFakeHist", Form("Merging %s histograms with suffix : %s", lepton, suf.Data()));
+
+  //Sums per [quality][slot], the slots are pT (0), |eta| (1) and all_ (2)
+  const char *quality[2] = {"Loose", "Tight"};
+  TH1F *hFakes[2][3];
+  for(int q(0); q<2; q++){
+    hFakes[q][0] = (TH1F*) (this->findHisto(Form("histo%s_%s0",    quality[q], flavor), histos))->Clone(Form("histo%s_Fakes_%s0",    quality[q], lepton));
+    hFakes[q][1] = (TH1F*) (this->findHisto(Form("histo%s_%s1",    quality[q], flavor), histos))->Clone(Form("histo%s_Fakes_%s1",    quality[q], lepton));
+    hFakes[q][2] = (TH1F*) (this->findHisto(Form("all_histo%s_%s", quality[q], flavor), histos))->Clone(Form("all_histo%s_Fakes_%s", quality[q], lepton));
+    for(int i(0); i<3; i++){ hFakes[q][i]->SetDirectory(0); hFakes[q][i]->Reset(); }
   }
 
-  if( opt=="El" ){
-    for(auto suf : FakeSourcesEl) DEBUG("addFakeHist", Form("Merging electron histograms with suffix : %s", suf.Data()));
+  const std::vector<TString> &names = histos.names();
+  const std::vector<HistKey> &keys  = histos.histKeys();
+  for(unsigned int i(0); i<keys.size(); i++){
+    const HistKey &key = keys[i];
+    if(key.dim!=1 || key.slot()<0 || key.quality==HistKey::NoQuality) continue;
+    if(key.flavor != (muon ? HistKey::Muon : HistKey::Electron) || !key.source.Length()) continue;
+    if(std::find(sources.begin(), sources.end(), key.source) == sources.end()) continue;
 
-    h0_loose = (TH1F*) (this->findHisto("histoLoose_el0",    histos))->Clone("histoLoose_Fakes_electron0");
-    h1_loose = (TH1F*) (this->findHisto("histoLoose_el1",    histos))->Clone("histoLoose_Fakes_electron1");
-    hA_loose = (TH1F*) (this->findHisto("all_histoLoose_el", histos))->Clone("all_histoLoose_Fakes_electron");
-    
-    h0_tight = (TH1F*) (this->findHisto("histoTight_el0",    histos))->Clone("histoTight_Fakes_electron0");
-    h1_tight = (TH1F*) (this->findHisto("histoTight_el1",    histos))->Clone("histoTight_Fakes_electron1");
-    hA_tight = (TH1F*) (this->findHisto("all_histoTight_el", histos))->Clone("all_histoTight_Fakes_electron");
-    
-    h0_loose->Reset(); h0_tight->Reset();
-    h1_loose->Reset(); h1_tight->Reset();
-    hA_loose->Reset(); hA_tight->Reset();
-
-    for(auto h : histos){
-      TString hname = h->GetName();
-
-      for(auto suf : FakeSourcesEl){
-
-	if(hname.Contains(suf) && hname.Contains("histoLoose")     && hname.Contains("electron0")) h0_loose->Add(h);
-	if(hname.Contains(suf) && hname.Contains("histoLoose")     && hname.Contains("electron1")) h1_loose->Add(h);
-	if(hname.Contains(suf) && hname.Contains("all_histoLoose") && hname.Contains("electron") ) hA_loose->Add(h);
-	
-	if( (suf=="charge_flip" || suf=="conversion") ){ 
-	  if( hname.Contains(suf) && hname.Contains("histoLoose")  && hname.Contains("0") ) h0_loose->Add(h);
-	  if( hname.Contains(suf) && hname.Contains("histoLoose")  && hname.Contains("1") ) h1_loose->Add(h);
-	  if( hname.Contains(suf) && hname.Contains("all_histoLoose")                     ) hA_loose->Add(h);
-	}
-
-	if(hname.Contains(suf) && hname.Contains("histoTight")     && hname.Contains("electron0")) h0_tight->Add(h);
-	if(hname.Contains(suf) && hname.Contains("histoTight")     && hname.Contains("electron1")) h1_tight->Add(h);
-	if(hname.Contains(suf) && hname.Contains("all_histoTight") && hname.Contains("electron") ) hA_tight->Add(h);
-	
-	if( (suf=="charge_flip" || suf=="conversion") ){  
-	  if( hname.Contains(suf) && hname.Contains("histoTight")  && hname.Contains("0") ) h0_tight->Add(h);
-	  if( hname.Contains(suf) && hname.Contains("histoTight")  && hname.Contains("1") ) h1_tight->Add(h);
-	  if( hname.Contains(suf) && hname.Contains("all_histoTight")                     ) hA_tight->Add(h);
-	}
-      }
-    }
-  } 
-  histos.push_back(h0_loose); histos.push_back(h0_tight);
-  histos.push_back(h1_loose); histos.push_back(h1_tight);
-  histos.push_back(hA_loose); histos.push_back(hA_tight);
- 
+    TH1F *h = histos.find(names[i]);
+    if(h) hFakes[key.quality][key.slot()]->Add(h);
+  }
+  for(int i(0); i<3; i++){
+    for(int q(0); q<2; q++) histos.add(hFakes[q][i]);
+  }
   return;
 }
 
@@ -1324,6 +2716,7 @@ void RatePlotter::getMCSources(TString flavor, TString quality, bool log){
   std::cout << std::endl;
   if(!MCRates){ INFO("getMCSources", "No MC input provided"); return;}
 
+  histosMC.deleteAll();
   histosMC = getHistosFromList(MCFiles, effDir);
   this->lumiScale(histosMC);
 
@@ -1335,24 +2728,29 @@ void RatePlotter::getMCSources(TString flavor, TString quality, bool log){
   sources.insert(sources.begin(), "prompt");
   sources.push_back("Fakes");
 
+  int flavorId  = (flavor=="el") ? HistKey::Electron : HistKey::Muon;
+  int qualityId = (quality=="Loose") ? HistKey::Loose : HistKey::Tight;
+
   std::vector<TH1F*> hSources0(0), hSources1(0);
+  const std::vector<TString> &names = histosMC.names();
+  const std::vector<HistKey> &keys  = histosMC.histKeys();
   for(auto source : sources){
-    for(auto h : histosMC){
-      if(isAllHist(h)) continue;
-      TString name = h->GetName();
-    
-      if(name.Contains(flavor) && name.Contains(quality) && name.Contains(source) && name.Contains("0")) hSources0.push_back(h);
-      if(name.Contains(flavor) && name.Contains(quality) && name.Contains(source) && name.Contains("1")) hSources1.push_back(h);
-
-      if(flavor=="el" && name.Contains(quality) && name.Contains(source) && source=="charge_flip" && name.Contains("0")) hSources0.push_back(h);
-      if(flavor=="el" && name.Contains(quality) && name.Contains(source) && source=="conversion"  && name.Contains("0")) hSources0.push_back(h);
-      
-      if(flavor=="el" && name.Contains(quality) && name.Contains(source) && source=="charge_flip" && name.Contains("1")) hSources1.push_back(h);
-      if(flavor=="el" && name.Contains(quality) && name.Contains(source) && source=="conversion"  && name.Contains("1")) hSources1.push_back(h);
+    for(unsigned int i(0); i<keys.size(); i++){
+      const HistKey &key = keys[i];
+      if(key.all || key.source!=source || key.quality!=qualityId || key.flavor!=flavorId) continue;
+      if(key.slot()!=0 && key.slot()!=1) continue;
+
+      //Drawn copies stay valid when histosMC is released by the next call
+      TH1F *h = findHisto(names[i], histosMC);
+      if(!h) continue;
+      h = this->track((TH1F*)h->Clone(), "getMCSources");
+      h->SetDirectory(0);
+      if(key.slot()==0) hSources0.push_back(h);
+      else hSources1.push_back(h);
     }
   }
-  for(auto h : hSources0) DEBUG("getMCSources", Form("Looking at %s \t :: Nevents=%.8f",h->GetName(),h->Integral()));
-  for(auto h : hSources1) DEBUG("getMCSources", Form("Looking at %s \t :: Nevents=%.8f",h->GetName(),h->Integral()));
+  for(auto h : hSources0) RP_DEBUG("getMCSources", Form("Looking at %s \t :: Nevents=%.8f",h->GetName(),h->Integral()));
+  for(auto h : hSources1) RP_DEBUG("getMCSources", Form("Looking at %s \t :: Nevents=%.8f",h->GetName(),h->Integral()));
 
   TCanvas *c[2];
   TString cname[2];
@@ -1360,13 +2758,15 @@ void RatePlotter::getMCSources(TString flavor, TString quality, bool log){
     cname[i] = Form("Sources_%s%s_p%i",flavor.Data(),quality.Data(),i);
     cname[i] = addSuffix(cname[i].Data());
 
-    c[i] =  new TCanvas(cname[i], cname[i], 1, 10, 770, 560);
+    c[i] =  this->track(new TCanvas(cname[i], cname[i], 1, 10, 770, 560), "getMCSources");
     c[i]->SetLeftMargin(0.10);
     if(log) c[i]->SetLogy();
   }
 
-  TH1F* hTemp0 = (TH1F*)(hSources0.back())->Clone(Form("Template_%s",hSources0.back()->GetName()));
-  TH1F* hTemp1 = (TH1F*)(hSources1.back())->Clone(Form("Template_%s",hSources1.back()->GetName()));
+  TH1F* hTemp0 = this->track((TH1F*)(hSources0.back())->Clone(Form("Template_%s",hSources0.back()->GetName())), "getMCSources");
+  TH1F* hTemp1 = this->track((TH1F*)(hSources1.back())->Clone(Form("Template_%s",hSources1.back()->GetName())), "getMCSources");
+  hTemp0->SetDirectory(0);
+  hTemp1->SetDirectory(0);
 
   hTemp0->GetYaxis()->SetRangeUser(1, (log ? hTemp0->GetMaximum()*700 : hTemp0->GetMaximum()*2));
   hTemp1->GetYaxis()->SetRangeUser(1, (log ? hTemp1->GetMaximum()*700 : hTemp1->GetMaximum()*2));
@@ -1419,6 +2819,7 @@ void RatePlotter::getMCSources(TString flavor, TString quality, bool log){
   case 8: leg = new TLegend(0.63, 0.58, 0.85, 0.91); break;
   default: break;
   }
+  this->track(leg, "getMCSources");
   leg->SetNColumns(1);
   leg->SetBorderSize(1);
   leg->SetTextFont(42);
@@ -1431,34 +2832,29 @@ void RatePlotter::getMCSources(TString flavor, TString quality, bool log){
   this->drawLeptonFlavor(hTemp0, true);
   c[0]->RedrawAxis();
 
+  //Each canvas owns what is drawn on it, the second one gets its own legend
   c[1]->cd();
-  leg->Draw("SAME");
+  this->track((TLegend*)leg->Clone(), "getMCSources")->Draw("SAME");
   this->drawLeptonFlavor(hTemp1, true);
   c[1]->RedrawAxis();
 
   if(Print){
-    if(!(bool)outDir.length()) outDir = ".";
-    this->checkDir(outDir);
-
-    for(unsigned int i(0); i<2; i++){
-      c[i]->Print(Form("%s/%s.%s",outDir.c_str(),c[i]->GetName(),figType));
-      INFO("getMCSources", Form("Created %s/%s.%s",outDir.c_str(),c[i]->GetName(),figType));
-    }
+    for(unsigned int i(0); i<2; i++) this->exportCanvas(c[i], "getMCSources");
   }
   return;
 }
 
 void::RatePlotter::setSourceStyle(TH1F *h){
   if(!h) return;
-  TString name = h->GetName();
-  if(name.Contains("_HF"))              h->SetFillColor(kGreen-6);
-  if(name.Contains("_LF"))              h->SetFillColor(kBlue-7);
-  if(name.Contains("_charge_flip"))     h->SetFillColor(kMagenta-7);
-  if(name.Contains("_conversion"))      h->SetFillColor(kCyan-3);  
-  if(name.Contains("_Tau"))             h->SetFillColor(kViolet-8);
-  if(name.Contains("_not_classified"))  h->SetFillColor(kOrange-9);
-  if(name.Contains("_Fakes"))           h->SetFillColor(kRed+3);
-  if(name.Contains("_prompt"))          h->SetFillColor(kGray);
+  const TString &source = this->histKey(h->GetName()).source;
+  if(source=="HF")              h->SetFillColor(kGreen-6);
+  if(source=="LF")              h->SetFillColor(kBlue-7);
+  if(source=="charge_flip")     h->SetFillColor(kMagenta-7);
+  if(source=="conversion")      h->SetFillColor(kCyan-3);  
+  if(source=="Tau")             h->SetFillColor(kViolet-8);
+  if(source=="not_classified")  h->SetFillColor(kOrange-9);
+  if(source=="Fakes")           h->SetFillColor(kRed+3);
+  if(source=="prompt")          h->SetFillColor(kGray);
 
   h->SetLineColor(kWhite);
   h->SetMarkerColor(kWhite);
@@ -1471,14 +2867,13 @@ void::RatePlotter::subtractNominal(TFile *f, TH1 *hVar){
   if(!subNomRate || !sysSuffix.length() || !hVar) return;
   TString nameVar(hVar->GetName());
 
-  TH1* h(0); TKey *key(0);
-  TIter next(f->GetListOfKeys());
-  while(( key = (TKey*)next() )){
-    TObject *obj = key->ReadObj();
-    if(!obj->IsA()->InheritsFrom("TH1")) continue;
-    h = (TH1*)obj;
-    TString name = h->GetName();
-    if( nameVar.Contains(name) && !name.Contains("__") ) break;
+  //The nominal name is the variation name without its "__suffix"
+  TH1* h(0);
+  int pos = nameVar.Index("__");
+  if(pos>0){
+    std::map<std::string, TH1*> &index = this->nominalIndex(f);
+    auto nom = index.find(TString(nameVar(0,pos)).Data());
+    if(nom != index.end()) h = nom->second;
   }
   if(!h){ INFO("subtractNominal", Form("No nominal histogram for variation %s is found. Check root file", hVar->GetName())); return; }
   INFO("subtractNominal", Form("Subtract %s (nominal) from %s (syst. variation)",h->GetName(),hVar->GetName()));
@@ -1489,7 +2884,7 @@ void::RatePlotter::subtractNominal(TFile *f, TH1 *hVar){
       float nom = h->GetBinContent(i), var = hVar->GetBinContent(i);
 
       hVar->SetBinContent(i, TMath::Abs(var-nom));
-      DEBUG("subtractNominal", Form("Bin (%i) Subtract %.3f vom %.3f --> %.3f",i,nom,var,hVar->GetBinContent(i)));
+      RP_DEBUG("subtractNominal", Form("Bin (%i) Subtract %.3f vom %.3f --> %.3f",i,nom,var,hVar->GetBinContent(i)));
     }
     break;
   case 2:
@@ -1498,7 +2893,7 @@ void::RatePlotter::subtractNominal(TFile *f, TH1 *hVar){
 	float nom = h->GetBinContent(i,j), var = hVar->GetBinContent(i,j);
 
 	hVar->SetBinContent(i, j, TMath::Abs(var-nom));
-	DEBUG("subtractNominal", Form("Bin (%i|%i) Subtract %.3f vom %.3f --> %.3f",i,j,nom,var,hVar->GetBinContent(i,j)));
+	RP_DEBUG("subtractNominal", Form("Bin (%i|%i) Subtract %.3f vom %.3f --> %.3f",i,j,nom,var,hVar->GetBinContent(i,j)));
       }
     }
     break;
@@ -1508,29 +2903,223 @@ void::RatePlotter::subtractNominal(TFile *f, TH1 *hVar){
 }
 
 void RatePlotter::subtract(TH1 *h1, TH1*h2, float sf){
-  if(!h1 || !h2) return;
-  if(h1->GetDimension() != h2->GetDimension()){ INFO("subtractHist", "Cannot subtract TH1s with different dimensions"); return; }
+  this->subtract(h1, SubtractionTerms(1, std::make_pair(h2, sf)));
+}
 
-  switch( (int)h1->GetDimension() ){
-  case 1:
-    for(int i(0); i<=h1->GetNbinsX()+1; i++){
-      float val = TMath::Max(h1->GetBinContent(i) - h2->GetBinContent(i)*sf,0.);
-      float err = TMath::Sqrt(TMath::Power(h1->GetBinError(i),2) + TMath::Power(h2->GetBinError(i),2));
-      h1->SetBinContent(i,val);
-      h1->SetBinError(i,err);
+void RatePlotter::subtract(TH1 *hTot, TH1 *hPass, const SubtractionPairs &pairs){
+  SubtractionTerms termsTot(0), termsPass(0);
+  for(auto &pair : pairs){
+    if(pair.total) termsTot.push_back(std::make_pair(pair.total, pair.sf));
+    if(pair.pass)  termsPass.push_back(std::make_pair(pair.pass, pair.sf));
+  }
+  this->subtract(hTot,  termsTot);
+  this->subtract(hPass, termsPass);
+}
+
+void RatePlotter::subtract(TH1 *h, const SubtractionTerms &terms){
+  if(!h) return;
+  //Float histograms are read from their arrays; other types (TH1D, TH2D, ...) go through
+  //GetBinContent/SetBinContent with the same arithmetic
+  TArrayF *target = dynamic_cast<TArrayF*>(h);
+
+  std::vector<const float*>  content(0);
+  std::vector<const double*> sumw2(0);
+  std::vector<TH1*>          hists(0);
+  std::vector<double>        sf(0);
+  for(auto &term : terms){
+    TH1 *hSub = term.first;
+    if(!hSub) continue;
+    if(hSub->GetDimension() != h->GetDimension() || hSub->GetNcells() != h->GetNcells()){ 
+      INFO("subtractHist", Form("Cannot subtract %s from %s with different binning", hSub->GetName(), h->GetName())); continue; 
     }
-    break;
-  case 2:
-    for(int i(0); i<=h1->GetNbinsX()+1; i++){
-      for(int j(0); j<=h1->GetNbinsY()+1; j++){
-	float val = TMath::Max(h1->GetBinContent(i,j) - h2->GetBinContent(i,j)*sf,0.);
-	float err = TMath::Sqrt(TMath::Power(h1->GetBinError(i,j),2)+TMath::Power(h2->GetBinError(i,j),2));
-	h1->SetBinContent(i,j,val);
-	h1->SetBinError(i,j,err);
-      }
+    TArrayF *array = dynamic_cast<TArrayF*>(hSub);
+    content.push_back(array ? array->GetArray() : 0);
+    sumw2.push_back(hSub->GetSumw2N() ? hSub->GetSumw2()->GetArray() : 0);
+    hists.push_back(hSub);
+    sf.push_back(term.second);
+  }
+  if(hists.empty()) return;
+  if(!h->GetSumw2N()) h->Sumw2();
+  StageTimer timer(Stats, "subtract");
+
+  //One pass over all cells incl. under-/overflow, errors of all terms are added in quadrature
+  float  *val  = target ? target->GetArray() : 0;
+  double *err2 = h->GetSumw2()->GetArray();
+  double entries = h->GetEntries();
+  int nCells(h->GetNcells()), nTerms(hists.size());
+  for(int i(0); i<nCells; i++){
+    double v(val ? val[i] : h->GetBinContent(i)), e2(err2[i]);
+    for(int k(0); k<nTerms; k++){
+      double c = content[k] ? content[k][i] : hists[k]->GetBinContent(i);
+      v  -= c*sf[k];
+      e2 += sumw2[k] ? sumw2[k][i] : std::fabs(c);
+      if(!ClampOnce) v = std::max(v, 0.);
     }
-    break;
-  default: break;
+    if(val) val[i] = std::max(v, 0.);
+    else h->SetBinContent(i, std::max(v, 0.));
+    err2[i] = e2;
   }
+  //SetBinContent counts an entry per call
+  if(!val) h->SetEntries(entries);
+  RP_DEBUG("subtractHist", Form("Subtracted %i histograms from %s", nTerms, h->GetName()));
   return;
 }
+
+FakeRateLookup::Axis FakeRateLookup::makeAxis(const TAxis *axis){
+  Axis a;
+  a.n     = axis->GetNbins();
+  a.fixed = !axis->GetXbins()->GetSize();
+  a.xmin  = axis->GetXmin();
+  a.xmax  = axis->GetXmax();
+  a.edges.resize(a.n+1);
+  for(int i(0); i<=a.n; i++) a.edges[i] = axis->GetBinLowEdge(i+1);
+  return a;
+}
+
+bool FakeRateLookup::sameLayout(const TH1 *h1, const TH1 *h2){
+  if(h1->GetDimension() != h2->GetDimension() || h1->GetNcells() != h2->GetNcells()) return false;
+  for(int d(0); d<h1->GetDimension(); d++){
+    const TAxis *a1 = d ? h1->GetYaxis() : h1->GetXaxis();
+    const TAxis *a2 = d ? h2->GetYaxis() : h2->GetXaxis();
+    for(int i(1); i<=a1->GetNbins()+1; i++){ if(a1->GetBinLowEdge(i) != a2->GetBinLowEdge(i)) return false; }
+  }
+  return true;
+}
+
+//Same bin as TAxis::FindFixBin: the arithmetic of fixed axes, otherwise the number of edges <= x,
+//counted with a branchless binary search
+int FakeRateLookup::Axis::find(double x, bool clamp) const {
+  int bin(0);
+  if(fixed){
+    if(x < xmin) bin = 0;
+    else if(!(x < xmax)) bin = n+1;
+    else bin = 1 + int(n*(x-xmin)/(xmax-xmin));
+  }
+  else{
+    const double *base = edges.data();
+    int len = n+1;
+    while(len > 1){
+      int half = len/2;
+      base += (base[half] <= x) ? half : 0;
+      len  -= half;
+    }
+    bin = (base - edges.data()) + (*base <= x);
+  }
+  if(clamp) bin = std::min(std::max(bin, 1), n);
+  return bin;
+}
+
+bool FakeRateLookup::load(const char* filename){
+  TDirectory::TContext context;
+  TFile *f = TFile::Open(filename, "READ");
+  if(!f || f->IsZombie()){ std::cout << Form("FakeRateLookup::load() \t\t INFO \t Cannot open %s", filename) << std::endl; delete f; return false; }
+
+  //Highest cycle of every rate map, the toy covariances are not rates
+  std::map<std::string, TKey*> keys = latestKeys(f);
+
+  //Nominal maps first, then their variations in name order
+  std::map<std::string, std::vector<TH1*> > families;
+  for(auto &k : keys){
+    TString name = k.first;
+    if(isCovariance(name)) continue;
+    int pos = name.Index("__");
+    std::string base = (pos<0) ? k.first : std::string(TString(name(0,pos)).Data());
+    TH1 *h = (TH1*)k.second->ReadObj();
+    h->SetDirectory(0);
+    if(pos<0) families[base].insert(families[base].begin(), h);
+    else families[base].push_back(h);
+  }
+  f->Close();
+  delete f;
+
+  int nLoaded(0);
+  for(auto &fam : families){
+    std::vector<TH1*> &hists = fam.second;
+    TH1 *hNom = hists[0];
+    if(fam.first != hNom->GetName() || hNom->GetDimension() > 2){
+      std::cout << Form("FakeRateLookup::load() \t\t INFO \t No nominal map for %s, skipping its variations", fam.first.c_str()) << std::endl;
+      for(auto h : hists) delete h;
+      continue;
+    }
+    if(index.count(fam.first)) std::cout << Form("FakeRateLookup::load() \t\t INFO \t Replacing %s with the map of %s", fam.first.c_str(), filename) << std::endl;
+
+    Map m;
+    m.dim = hNom->GetDimension();
+    m.x   = makeAxis(hNom->GetXaxis());
+    m.y   = makeAxis(hNom->GetYaxis());
+    for(auto h : hists){
+      if(h != hNom && !sameLayout(hNom, h)){
+	std::cout << Form("FakeRateLookup::load() \t\t INFO \t %s has a different binning than %s, skipping", h->GetName(), hNom->GetName()) << std::endl;
+	continue;
+      }
+      m.names.push_back(h->GetName());
+    }
+
+    //Rates of all variations, then their errors; every block starts on a 64 byte boundary
+    int nCells = hNom->GetNcells(), nVar = m.names.size();
+    m.stride = (nCells+7)/8*8;
+    m.buffer.assign(2*nVar*m.stride + 8, 0.);
+    int shift = ((64 - reinterpret_cast<std::uintptr_t>(m.buffer.data())%64)%64)/sizeof(double);
+    double *rates  = m.buffer.data() + shift;
+    double *errors = rates + nVar*m.stride;
+    int var(0);
+    for(auto h : hists){
+      if(var<nVar && m.names[var]==h->GetName()){
+	for(int i(0); i<nCells; i++){
+	  rates[var*m.stride+i]  = h->GetBinContent(i);
+	  errors[var*m.stride+i] = h->GetBinError(i);
+	}
+	var++;
+      }
+      delete h;
+    }
+    m.rates  = rates;
+    m.errors = errors;
+
+    if(index.count(fam.first)) maps[index[fam.first]] = std::move(m);
+    else{ index[fam.first] = maps.size(); maps.push_back(std::move(m)); }
+    nLoaded++;
+  }
+  std::cout << Form("FakeRateLookup::load() \t\t INFO \t Loaded %i rate maps from %s", nLoaded, filename) << std::endl;
+  return nLoaded > 0;
+}
+
+int FakeRateLookup::find(const char* name) const {
+  auto it = index.find(name);
+  return (it == index.end()) ? -1 : it->second;
+}
+
+int FakeRateLookup::variation(int map, const char* suffix) const {
+  const std::vector<std::string> &names = maps[map].names;
+  std::string name = (!suffix || !strlen(suffix)) ? names[0] : names[0]+"__"+suffix;
+  for(unsigned int i(0); i<names.size(); i++){ if(names[i]==name) return i; }
+  return -1;
+}
+
+int FakeRateLookup::bin(int map, double x, double y) const {
+  const Map &m = maps[map];
+  bool clamp = (policy == Clamp);
+  int bx = m.x.find(x, clamp);
+  if(m.dim == 1) return bx;
+  return bx + (m.x.n+2)*m.y.find(y, clamp);
+}
+
+void FakeRateLookup::rates(int map, int n, const double* x, const double* y, double* rate, double* err, int var) const {
+  const Map &m = maps[map];
+  const double *r = m.rates  + var*m.stride;
+  const double *e = m.errors + var*m.stride;
+  for(int i(0); i<n; i++){
+    int b = bin(map, x[i], y ? y[i] : 0.);
+    rate[i] = r[b];
+    if(err) err[i] = e[b];
+  }
+}
+
+void FakeRateLookup::allVariations(int map, double x, double y, double* rate, double* err) const {
+  const Map &m = maps[map];
+  int b = bin(map, x, y);
+  for(unsigned int v(0); v<m.names.size(); v++){
+    rate[v] = m.rates[v*m.stride + b];
+    if(err) err[v] = m.errors[v*m.stride + b];
+  }
+}
@@ -3,24 +3,345 @@
 #include <sstream>
 #include <stdio.h>
 #include <vector>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <cstring>
 #include <math.h>
+#include <sys/wait.h>
+#include "TROOT.h"
 #include "TSystem.h"
 #include "TStyle.h"
 #include "TFile.h"
 #include "TKey.h"
+#include "TMD5.h"
+#include "TPRegexp.h"
+#include "TRegexp.h"
 #include "TDirectory.h"
 #include "TCanvas.h"
+#include "TFrame.h"
 #include "TLatex.h"
 #include "TGraph.h"
 #include "TGraphErrors.h"
 #include "TGraphAsymmErrors.h"
+#include "TClass.h"
 #include "TMultiGraph.h"
 #include "TEfficiency.h"
+#include "Math/QuantFuncMathCore.h"
 #include "TLegend.h"
 #include "TLine.h"
 #include "TH1.h"
 #include "TH2.h"
+#include "TRandom3.h"
 #include "TF1.h"
+#include "OutputKeys.h"
+
+// The message of RP_DEBUG is only formatted when debug output is enabled,
+// compiling with -DRATEPLOTTER_NODEBUG removes the debug statements altogether
+#ifdef RATEPLOTTER_NODEBUG
+#define RP_DEBUG(app, msg) do{ }while(0)
+#else
+#define RP_DEBUG(app, msg) do{ if(Debug) DEBUG(app, msg); }while(0)
+#endif
+
+// Structured form of an input histogram name, parsed once instead of matching substrings:
+//   [all_]histo<Quality>_<el|mu|Source_electron|Source_muon|Source><axis>, e.g. histoTight_el0, all_histoLoose_HF_muon
+//   histo2D_<Quality>_<el|mu|Source_electron|Source_muon|Source>,          e.g. histo2D_Loose_charge_flip
+// Derived names (Template_<name>, <pass>_<total>, <pass>_over_<total>, <name>__<suffix>) take the key of their first input name.
+struct HistKey
+{
+  enum Quality { NoQuality=-1, Loose=0, Tight=1 };
+  enum Flavor  { NoFlavor=-1, Electron=0, Muon=1 };
+
+  HistKey() : quality(NoQuality), flavor(NoFlavor), axis(-1), dim(0), all(false), source("") {};
+  static HistKey parse(const TString& name);
+  static bool electronOnly(const TString& source){ return source=="charge_flip" || source=="conversion"; }
+
+  bool valid() const { return dim > 0; }
+  bool inclusive() const { return valid() && !source.Length(); }
+  //Slot of a 1D histogram: 0 (pT), 1 (|eta|) or 2 (all_, pT x |eta| unrolled), -1 otherwise
+  int slot() const { return dim!=1 ? -1 : (all ? 2 : ((axis==0 || axis==1) ? axis : -1)); }
+
+  int quality;
+  int flavor;
+  int axis;
+  int dim;
+  bool all;
+  TString source;
+};
+
+class HistRegistry
+{
+ public:
+  HistRegistry(){ 
+    histos.clear(); 
+    index.clear(); 
+    histos2D.clear();
+    index2D.clear();
+    keys.clear();
+    parsed.clear();
+    known.clear();
+    sourceFiles.clear();
+    sourceDir  = "";
+    lazyScale  = 1.0;
+    lazySubtr.clear();
+  };
+  ~HistRegistry(){};
+
+ public:
+  bool  add(TH1F* h);
+  bool  add(TH2F* h);
+  TH1F* find(const TString& name) const;
+  TH2F* find2D(const TString& name) const;
+  bool  contains(const TString& name) const { return index.count(name.Data()) > 0 || index2D.count(name.Data()) > 0; }
+  bool  isPending(const TString& name) const { return known.count(name.Data()) > 0 && !contains(name); }
+  void  addPending(const TString& name);
+  void  merge(const HistRegistry& other, std::vector<TString> &onlyHere, std::vector<TString> &onlyOther);
+  void  deleteAll();
+  void  clear(){ histos.clear(); index.clear(); histos2D.clear(); index2D.clear(); keys.clear(); parsed.clear(); known.clear(); }
+
+  bool empty() const { return keys.empty(); }
+  unsigned int size() const { return histos.size() + histos2D.size(); }
+  const std::vector<TH1F*>& list() const { return histos; }
+  const std::vector<TH2F*>& list2D() const { return histos2D; }
+  const std::vector<TString>& names() const { return keys; }
+  // Parsed keys, in the order of names()
+  const std::vector<HistKey>& histKeys() const { return parsed; }
+
+  //Lazy mode: input files and corrections applied to histograms read after creation
+  void setSource(const std::vector<std::string> &files, const char* dir){ sourceFiles = files; sourceDir = dir; }
+  const std::vector<std::string>& getSourceFiles() const { return sourceFiles; }
+  const char* getSourceDir() const { return sourceDir.c_str(); }
+
+  void  setLazyScale(float sf){ lazyScale = sf; }
+  float getLazyScale() const { return lazyScale; }
+  void  addLazySubtraction(const HistRegistry& h){ lazySubtr.push_back(h); }
+  std::vector<HistRegistry>& getLazySubtractions(){ return lazySubtr; }
+
+ private:
+  std::vector<TH1F*> histos;
+  std::unordered_map<std::string, unsigned int> index;
+  std::vector<TH2F*> histos2D;
+  std::unordered_map<std::string, unsigned int> index2D;
+
+  std::vector<TString> keys;
+  std::vector<HistKey> parsed;
+  std::unordered_map<std::string, bool> known;
+
+  std::vector<std::string> sourceFiles;
+  std::string sourceDir;
+  float lazyScale;
+  std::vector<HistRegistry> lazySubtr;
+};
+
+// Wall time and number of calls per processing stage and counters of a run.
+// Stages running in worker threads add up the time of all threads, nested stages
+// are also counted in the enclosing stage.
+class RunStats
+{
+ public:
+  RunStats(){ clear(); };
+  ~RunStats(){};
+
+ public:
+  void   addTime(const std::string& stage, double seconds);
+  void   count(const std::string& counter, double n=1.);
+  void   clear();
+  double wallTime() const { return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count(); }
+  const std::vector<std::string>& stageNames() const { return order; }
+  double time(const std::string& stage) const { return stages.count(stage) ? stages.at(stage).first : 0.; }
+  long   calls(const std::string& stage) const { return stages.count(stage) ? stages.at(stage).second : 0; }
+  const std::map<std::string, double>& counters() const { return counts; }
+  bool   writeJSON(const char* filename) const;
+
+ private:
+  std::vector<std::string> order;
+  std::map<std::string, std::pair<double, long> > stages;
+  std::map<std::string, double> counts;
+  std::chrono::steady_clock::time_point start; //!
+  mutable std::mutex lock; //!
+};
+
+// Adds the time until the end of the scope to a stage of RunStats
+class StageTimer
+{
+ public:
+  StageTimer(RunStats &s, const char* name) : stats(s), stage(name), start(std::chrono::steady_clock::now()) {};
+  ~StageTimer(){ stats.addTime(stage, std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()); };
+
+ private:
+  RunStats &stats;
+  const char* stage;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Live histograms, graphs and canvases created by RatePlotter, grouped by the creating method.
+// Tracked objects get kMustCleanup, so their deletion is reported through RecursiveRemove.
+class MemoryTracker : public TObject
+{
+ public:
+  MemoryTracker(){ live.clear(); registered = false; };
+  ~MemoryTracker(){ stop(); };
+
+ public:
+  void add(TObject *obj, const char* method);
+  void RecursiveRemove(TObject *obj);
+  void stop();
+  int  size() const { return live.size(); }
+  void summary(std::map<std::string, std::vector<double> > &counts) const;
+  static int    category(TObject *obj);
+  static double bytes(TObject *obj);
+
+ private:
+  std::map<TObject*, std::string> live;
+  bool registered;
+  mutable std::mutex lock; //!
+
+  ClassDef(MemoryTracker, 0)
+};
+
+// Keeps the Efficiency*.root output files open in UPDATE mode and writes queued histograms
+// in batches on a background thread. Every access to the files has to hold fileMutex().
+// ROOT thread safety has to be enabled before the first open(), RatePlotter does so on construction.
+class OutputWriter : public TObject
+{
+ public:
+  OutputWriter(){ running = false; stopping = false; writing = false; registered = false; nWritten = 0; };
+  ~OutputWriter(){ close(); };
+
+ public:
+  TFile* open(const std::string& filename);
+  void   queue(const std::string& filename, TH1 *h);
+  void   flush();
+  void   close();
+  void   RecursiveRemove(TObject *obj);
+  std::mutex& fileMutex(){ return fileLock; }
+  int    written() const { return nWritten; }
+
+ private:
+  void   run();
+
+  std::map<std::string, TFile*> files;
+  std::vector< std::pair<std::string, TH1*> > pending;
+  std::thread worker; //!
+  std::mutex fileLock; //!
+  std::mutex queueLock; //!
+  std::condition_variable wake; //!
+  std::condition_variable idle; //!
+  bool running;
+  bool stopping;
+  bool writing;
+  bool registered;
+  int  nWritten;
+
+  ClassDef(OutputWriter, 0)
+};
+
+// Named systematic variation of RatePlotter::runVariations. Empty fields keep the nominal setup:
+// the selection directory (dirFrom replaced by dirTo, or dirTo alone), process scale factors,
+// input files and luminosity.
+struct SysVariation
+{
+  SysVariation(std::string n = "") : name(n), dirFrom(""), dirTo(""), lumi(-1.) {};
+
+  std::string name;
+  std::string dirFrom;
+  std::string dirTo;
+  float lumi;
+  std::vector< std::pair<TString, float> > procSF;
+  std::vector<std::string> mcFiles;
+  std::vector<std::string> dataFiles;
+  std::vector<std::string> promptFiles;
+};
+
+// Rule of RatePlotter::combineVariations: variations whose suffix matches the regular expression
+// form one group, summed linearly (correlated) or by their largest shift (envelope)
+struct VariationGroup
+{
+  TString pattern;
+  std::string name;
+  bool envelope;
+};
+
+// Read-only lookup of the rate maps in the Efficiency*.root outputs for the event loop. A map and
+// its "__suffix" variations share one bin layout and are stored as flat arrays in the global bin
+// order of TH1 (under-/overflow included), aligned to 64 bytes, with the bin edges kept per axis.
+// One bin search serves the nominal and all variations; the values are those of GetBinContent and
+// GetBinError. Outside the axes, Clamp uses the first/last bin and Flow the under-/overflow bin.
+// All lookups are const and can run concurrently once load() has returned.
+//   FakeRateLookup lookup;
+//   lookup.load("Efficiency2D_Data.root");
+//   int map = lookup.find("FakeEfficiency2D_el_pt_eta");
+//   double rate = lookup.rate(map, pt, fabs(eta));
+class FakeRateLookup
+{
+ public:
+  enum Policy { Clamp=0, Flow=1 };
+
+  FakeRateLookup(Policy p = Clamp) : policy(p) {};
+  FakeRateLookup(const FakeRateLookup&) = delete;
+  FakeRateLookup& operator=(const FakeRateLookup&) = delete;
+  ~FakeRateLookup(){};
+
+ public:
+  bool   load(const char* filename);
+  void   setPolicy(Policy p){ policy = p; }
+  int    size() const { return maps.size(); }
+  int    find(const char* name) const;
+  int    variation(int map, const char* suffix) const;
+  int    nVariations(int map) const { return maps[map].names.size(); }
+  const std::string& name(int map, int var=0) const { return maps[map].names[var]; }
+
+  int    bin(int map, double x, double y=0.) const;
+  double rate(int map, double x, double y=0., int var=0) const { const Map &m = maps[map]; return m.rates[var*m.stride + bin(map,x,y)]; }
+  double error(int map, double x, double y=0., int var=0) const { const Map &m = maps[map]; return m.errors[var*m.stride + bin(map,x,y)]; }
+  void   rates(int map, int n, const double* x, const double* y, double* rate, double* err=0, int var=0) const;
+  void   allVariations(int map, double x, double y, double* rate, double* err=0) const;
+
+ private:
+  struct Axis
+  {
+    int n;
+    bool fixed;
+    double xmin, xmax;
+    std::vector<double> edges;
+    int find(double x, bool clamp) const;
+  };
+  struct Map
+  {
+    int dim;
+    Axis x, y;
+    int stride;
+    std::vector<std::string> names;
+    std::vector<double> buffer;
+    const double *rates, *errors;
+  };
+
+  static Axis makeAxis(const TAxis *axis);
+  static bool sameLayout(const TH1 *h1, const TH1 *h2);
+
+  Policy policy;
+  std::vector<Map> maps;
+  std::map<std::string, int> index;
+};
+
+// (histogram, scale factor) pairs subtracted in one pass by RatePlotter::subtract
+typedef std::vector< std::pair<TH1*, float> > SubtractionTerms;
+
+// Pass and total histogram of one subtracted contribution with its scale factor, either may be missing
+struct SubtractionPair
+{
+  TH1 *pass;
+  TH1 *total;
+  float sf;
+};
+typedef std::vector<SubtractionPair> SubtractionPairs;
 
 class RatePlotter
 {
@@ -28,20 +349,38 @@ class RatePlotter
   RatePlotter(std::string name = "RatePlotter"){
     CNAME = name;
     std::cout << "Initialize Class " << CNAME << std::endl;
+    //The output writer runs on its own thread, before any output file or histogram is created
+    ROOT::EnableThreadSafety();
     Debug = 0;
     Print = 0;
     Style = 0;
     MCRates    = 0;
     DataRates  = 0;
     Prompt     = 0;
+    LazyLoad   = 0;
+    Recursive  = 0;
+    UseCache   = 1;
+    Streaming  = 0;
+    ClampOnce  = 0;
+    LogBuffer  = 0;
+    LogLimit   = 0;
+    TrackMemory = 0;
+    logCounts.clear();
     writeHist  = 0;
     AtlasLabel = 0;
     subNomRate = 0;
+    NToys      = 0;
+    ToySeed    = 4357;
+    activeVar  = 0;
     yMin      = 0.0;
     yMax      = 1.0;
     yRMin     = 0.0;
     yRMax     = 1.0;
     Lumi      = 1.0;
+    NThreads  = 1;
+    RenderWorkers = 0;
+    RenderFile    = 0;
+    renderJobs.clear();
     InFiles.clear();
     MCFiles.clear();
     DataFiles.clear();
@@ -52,8 +391,11 @@ class RatePlotter
     mcLabel   = "";
     dataLabel = "";
     stylePath = "";
+    renderStyle = "";
+    renderQueue = "";
     outFile   = "";
     sysSuffix = "";
+    cacheDir  = "";
     figType   = "pdf";
     histosMC.clear();
     histosData.clear();
@@ -61,11 +403,29 @@ class RatePlotter
     FakeSourcesMu.clear();
     subtractedProc.clear();
     subtractedProcSF.clear();
+    prefetchNames.clear();
+    fileFilters.clear();
+    fileClasses.clear();
+    variations.clear();
+    variationGroups.clear();
   };
-  ~RatePlotter(){};
+  ~RatePlotter(){ renderQueued(); flushOutput(); clearNominals(); closeFiles(); if(TrackMemory) memoryReport("Not freed at exit"); flushLog(); };
 
  public:
   void setDebug(bool debug);
+  // Buffered output is written by flushLog(); with a limit >0 only the first messages per method are shown
+  void setLogBuffer(bool buffer);
+  void setLogLimit(int limit);
+  void flushLog();
+  // Summary of time per stage and counters since construction (or resetRunReport), optionally as JSON
+  void runReport(const char* jsonFile="");
+  void resetRunReport();
+  // Count live histograms, graphs and canvases per creating method, memoryReport() prints a snapshot
+  void setMemoryTracking(bool track);
+  void memoryReport(const char* title="Live objects");
+  int  liveObjects() const { return Memory.size(); }
+  template<class T> T* track(T* obj, const char* method){ if(TrackMemory && obj) Memory.add(obj, method); return obj; }
+  void track(HistRegistry &histos, const char* method);
   void setPrint(bool print);
   void setStyle(bool setAtlas);
   void setLumi(float lumi);
@@ -76,25 +436,68 @@ class RatePlotter
   void getMCcolor(TGraphAsymmErrors *g, TString col); 
 
   void getFiles(const char* dirname, const char* key1="", const char* key2="");
+  void listFiles(const char* dirname, std::vector<std::string> &files);
+  void setRecursiveSearch(bool rec);
+  // Glob patterns ("*_mc16e_*.root") are matched against the file name, "re:" patterns against the full path
+  void addFileFilter(const char* pattern, bool include=true);
+  // Files matching the regex are classified as [Data|MC|Prompt|Skip]; default is AllYear -> Data, otherwise MC
+  void addFileClass(const char* pattern, const char* type);
+  bool passFileFilters(TString path);
+  TString classifyFile(TString path);
   void addMCFile(const char* filename);
   void addDataFile(const char* filename);
   void addPromptFile(const char* filename);
   void setEffDirectory(const char* dir);
+  void setLazyLoading(bool lazy);
+  void setThreads(int n);
+  void setStreaming(bool stream);
+  void closeFiles();
+  void setCacheDir(std::string dir);
+  void setUseCache(bool use);
+  void setPrefetchList(std::vector<TString> names){ prefetchNames = names; }
+  void prefetchHistos(HistRegistry &histos, std::vector<TString> names);
   void setStylePath(const char* path);
   void setRateType(const char *type);
   void setFigureFormat(const char* format){figType = format;}
+  // Exported canvases are written to a queue and rendered by renderQueued() in parallel 'root -b' processes
+  void setBatchRender(int workers);
+  void exportCanvas(TCanvas *c, const char* caller);
+  void releasePrimitives(TPad *pad);
+  void renderQueued();
   void writeHistFile(const char* outname, bool writeH=false);
   void writeToFile(TH1* hTemp, TString type, TString source, const char* outname);
+  // Writes all queued output histograms and closes the output files
+  void flushOutput();
+  void clearNominals();
 
   void unsetData(){ DataFiles.clear(); DataRates = false; }
   void unsetMC(){ MCFiles.clear(); MCRates = false; }
   void unsetPrompt(){ PromptMCFiles.clear(); Prompt = false; }
 
-  void addFakeHist(std::vector<TH1F*> &histos, TString opt);
+  void addFakeHist(HistRegistry &histos, TString opt);
+  // Registers the *_Fakes_* names of the selected sources, summed on the first request
+  void addFakeKeys(HistRegistry &histos);
   void setFakeSourcesMuon(std::vector<TString> s){ FakeSourcesMu = s; }
   void setFakeSourcesElectron(std::vector<TString> s){ FakeSourcesEl = s; }
   void setSysSuffix(std::string suf){ sysSuffix = suf; }
 
+  // Systematic variations, computed after the nominal in one job by runVariations and written
+  // with the suffix "__<name>". Inputs of all variations are read once for the given directories.
+  void addVariation(const char* name);
+  void setVariationDirectory(const char* name, const char* from, const char* to);
+  void setVariationProcessSF(const char* name, TString proc, float sf);
+  void setVariationFiles(const char* name, const char* dirname, const char* key1="", const char* key2="");
+  void setVariationLumi(const char* name, float lumi);
+  void runVariations(std::function<void()> job, std::vector<std::string> dirnames);
+  std::string variationDir(const char* dirname);
+
+  // Writes <nominal>__TOTAL (quadrature sum of all variations and groups) and the envelopes
+  // <nominal>__TOTALUP/__TOTALDOWN into an output file, or into all output files below a directory (recursively).
+  // With subtracted, the variations hold |var-nom| as written by subtractNominalRates.
+  void addVariationGroup(const char* pattern, const char* group, bool envelope=false);
+  void combineVariations(const char* path, bool subtracted=true);
+  void combineVariationFile(const std::string& filename, bool subtracted);
+
   void setHistStyle(TH1F* h);
   void setHistStyle(TH2F *h);
   void setSourceStyle(TH1F *h); 
@@ -107,15 +510,25 @@ class RatePlotter
   void drawEtaRegions(TH1F* h, float yEnd, bool binLabels=false, int etaBins=5);
   void drawRatio(std::vector<TGraphAsymmErrors*> graphs, TH1F* h);
   void drawAtlasLabel(bool draw){AtlasLabel = draw;}
-  void lumiScale(std::vector<TH1F*> histos);
+  void lumiScale(HistRegistry &histos);
   
   void subtract(TH1 *h1, TH1* h2, float sf=1.);
-  void subtractPrompt(std::vector<TH1F*> data, std::vector<TH1F*> prompt);
+  void subtract(TH1 *h, const SubtractionTerms &terms);
+  void subtract(TH1 *hTot, TH1 *hPass, const SubtractionPairs &pairs);
+  // Clamp at zero once after all terms instead of after each term (result independent of the order)
+  void setClampOnce(bool once);
+  // Rates of makeRatePlot and makeRatePlot2D get the spread of nToys Poisson toys as uncertainty and a covariance map
+  void setToys(int nToys, unsigned int seed=4357);
+  void subtractPrompt(HistRegistry &data, HistRegistry &prompt);
   void setProcessSubtraction(TString proc, float sf=1.);
-  void subtractMCProcess(TH1F* histInputTot, TH1F *histInputPass, std::vector<TH1F*> histProc);
-  void subtractMCProcess2D(TH2F* histInputTot, TH2F *histInputPass, std::vector<std::string> files);
+  void subtractMCProcess(TH1F* histInputTot, TH1F *histInputPass, HistRegistry &histProc);
+  void subtractMCProcess2D(TH2F* histInputTot, TH2F *histInputPass, HistRegistry &histProc);
+  void getMCProcessTerms(TH1F* histInputTot, TH1F *histInputPass, HistRegistry &histProc, SubtractionPairs &terms);
+  void getMCProcessTerms2D(TH2F* histInputTot, TH2F *histInputPass, HistRegistry &histProc, SubtractionPairs &terms);
 
   void subtractNominal(TFile *f, TH1 *hVar);
+  // Nominal histograms (names without "__suffix") of an output file, read once and kept up to date by writeToFile
+  std::map<std::string, TH1*>& nominalIndex(TFile *f);
   void subtractNominalRates(bool sub){ subNomRate = sub; }
 
   bool checkEntries(TH1F *pass, TH1F *total);
@@ -136,11 +549,14 @@ class RatePlotter
   
   TString MSG(const char* fname){return Form("%s::%s() \t",CNAME.c_str(),fname);}
 
-  void INFO(const char* app,  const char* msg){std::cout << Form("%s::%s() \t\t INFO \t %s",CNAME.c_str(),app,msg) << std::endl;}
-  void DEBUG(const char* app, const char* msg){if(Debug) std::cout << Form("%s::%s() \t\t DEBUG \t %s",CNAME.c_str(),app,msg) << std::endl;}
-  void ERROR(const char* app, const char* msg){std::cout << Form("%s::%s() \t\t ERROR \t %s",CNAME.c_str(),app,msg) << std::endl; exit(1);}
+  void INFO(const char* app,  const char* msg){ writeLog(app, "INFO", msg, true); }
+  void DEBUG(const char* app, const char* msg){ if(Debug) writeLog(app, "DEBUG", msg, true); }
+  void ERROR(const char* app, const char* msg){ writeLog(app, "ERROR", msg, false); flushLog(); exit(1); }
+  void writeLog(const char* app, const char* level, const char* msg, bool limited);
 
   TString GetXTitle(TH1F *h);
+  // Parsed key of any histogram name, cached per name (main thread only)
+  const HistKey& histKey(const TString& name);
   TString getOriginLabel(TString name);
 
   float getMCNorm(TFile *f);
@@ -152,15 +568,50 @@ class RatePlotter
   TLegend* makeLegend(TGraphAsymmErrors *g1, TGraphAsymmErrors *g2, TString type1, TString type2);
 
   TFile* findFile(const char* name);
-  TH1F*  findHisto(TString name, std::vector<TH1F*> histos);
+  TFile* openFile(const char* filename, const char* dirname);
+  void   releaseFile(TFile *file);
+  void   countBytesRead(TFile *file, bool closing);
+  TH1F*  findHisto(TString name, HistRegistry &histos);
+  TH2F*  findHisto2D(TString name, HistRegistry &histos);
+  TH1*   loadHisto(TString name, HistRegistry &histos);
+  TH1*   readMerged(TString name, const std::vector<std::string> &filelist, const char* dirname);
+  TH1F*  readMergedFakes(TString name, HistRegistry &histos);
   
+  void  rateKernel(const float *pass, const float *total, float *val, float *err, int n);
+
+  // Poisson toys of pass, total and all subtraction terms, subtracted and divided per toy on NThreads threads.
+  // Terms with pass and total are fluctuated as (pass, total-pass), clamping follows subtract().
+  // Returns the standard deviation of the rate per bin and the covariance of the in-range bins in hCov.
+  TH1*  toyRates(TH1 *hPass, TH1 *hTotal, const SubtractionPairs &terms, TH2D *&hCov);
+  void  setToyErrors(TH1 *hRate, TH1 *hPass, TH1 *hTotal, TH1 *hToyErr, TH2D *hCov);
+  void  dropToyCov(TH1 *hRate);
   TH1F* divideTH1(TH1F* hPass, TH1F *hTotal);
   TH2F* divideTH2(TH2F* hPass, TH2F *hTotal);
 
   TGraphAsymmErrors* getRateGraph(TH1F *hPass, TH1F *hTotal, TString source="");
 
-  std::vector<TH1F*> getHistos(const char* filename, const char* dirname);
-  std::vector<TH1F*> getHistosFromList(std::vector<std::string> filelist, const char* dirname);
+  // Ownership: all histograms handed out by RatePlotter are detached from the input files
+  // (SetDirectory(0)) and stay valid after closeFiles(). Histograms in a returned HistRegistry
+  // belong to the caller (HistRegistry::deleteAll), except histosMC/histosData, which hold the
+  // inputs of the last make*/compare*/getMCSources call and are released by the next one. Rate
+  // histograms, graphs and canvases of these methods belong to the current ROOT session.
+  HistRegistry getHistos(const char* filename, const char* dirname);
+  HistRegistry readHistos(TDirectory *d, float scale);
+  HistRegistry mergeHistos(std::vector<std::string> filelist, const char* dirname);
+  std::vector<HistRegistry> getRegionHistos(std::vector<std::string> filelist, std::vector<std::string> dirnames);
+  void mergeFiles(std::vector<std::string> filelist, std::vector<std::string> dirnames, std::vector<HistRegistry> &histos, std::vector<TString> &messages, std::vector<TString> &failures);
+  HistRegistry copyHistos(const HistRegistry &histos);
+
+  void loadRegions(std::vector<std::string> dirnames);
+  void loadRegions(std::vector<std::string> filelist, std::vector<std::string> dirnames);
+  void clearRegions(){ regionHistos.clear(); }
+  TString getListKey(const std::vector<std::string> &filelist, const char* dirname);
+  HistRegistry getHistosFromList(std::vector<std::string> filelist, const char* dirname);
+  HistRegistry getKeysFromList(std::vector<std::string> filelist, const char* dirname);
+
+  TString getCacheKey(const std::vector<std::string> &filelist, const char* dirname);
+  bool readCache(TString key, HistRegistry &histos);
+  void writeCache(TString key, const HistRegistry &histos);
 
   std::vector<TGraphAsymmErrors*> vec(TGraphAsymmErrors *g1, TGraphAsymmErrors *g2);
   
@@ -173,17 +624,30 @@ class RatePlotter
   bool MCRates;
   bool DataRates;
   bool Prompt;
+  bool LazyLoad;
+  bool Recursive;
+  bool UseCache;
+  bool Streaming;
+  bool ClampOnce;
+  bool LogBuffer;
+  bool TrackMemory;
   bool writeHist;
   bool AtlasLabel;
   bool subNomRate;
 
   float Lumi;
+  int   NThreads;
+  int   NToys;
+  unsigned int ToySeed;
+  int   RenderWorkers;
+  int   LogLimit;
   float yMin;
   float yMax;
   float yRMin;
   float yRMax;
 
   TString RateType;
+  TString renderStyle;
 
   const char *effDir;
   const char *stylePath;
@@ -194,19 +658,46 @@ class RatePlotter
   std::vector<TString> FakeSourcesMu;
   std::vector<TString> subtractedProc;
   std::vector<float>   subtractedProcSF;
+  std::vector<TString> prefetchNames;
+  std::vector< std::pair<TString, bool> >    fileFilters;
+  std::vector< std::pair<TString, TString> > fileClasses;
 
   std::string outDir;
   std::string mcLabel;
   std::string dataLabel;
   std::string sysSuffix;
+  std::string cacheDir;
+  std::string renderQueue;
+
+  RunStats Stats;
+  MemoryTracker Memory;
+  OutputWriter Writer;
+  std::map<std::string, std::map<std::string, TH1*> > nominals;
+  std::unordered_map<std::string, HistKey> keyCache;
+  //Keyed by the rate itself: MC and Data rates of one plot share their name. A new rate at a reused address drops the entry
+  std::map<TH1*, TH2D*> toyCov;
+  std::ostringstream logStream;
+  std::map<std::string, int> logCounts;
+  std::mutex logLock; //!
+
+  TFile *RenderFile;
+  std::vector< std::pair<TString, TString> > renderJobs;
 
   std::vector<TFile*> InFiles;
+  std::map<TFile*, Long64_t> countedBytes;
   
   std::vector<std::string> MCFiles;
   std::vector<std::string> DataFiles;
   std::vector<std::string> PromptMCFiles;
 
-  std::vector<TH1F*> histosMC;
-  std::vector<TH1F*> histosData;
+  std::map<std::string, HistRegistry> regionHistos;
+
+  std::vector<SysVariation> variations;
+  std::vector<VariationGroup> variationGroups;
+  SysVariation *activeVar;
+  SysVariation& getVariation(const char* name);
+
+  HistRegistry histosMC;
+  HistRegistry histosData;
   
 };